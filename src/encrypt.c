@@ -0,0 +1,279 @@
+#define _POSIX_C_SOURCE 200809L // read(), write()
+#include "monocypher.h"
+#include "getopt.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Format:
+//
+//   header : nonce prefix (16 random bytes) | chunk size (4 bytes, LE)
+//   chunks : mac (16 bytes) | cipher text (chunk size bytes or less)
+//
+// Chunk i is locked with the nonce prefix | i (8 bytes, LE), and with
+// the header and a final flag (1 byte) as additional data.  Only the
+// last chunk is flagged, and it is always shorter than the chunk size
+// (possibly empty), so a truncated stream never looks complete, and
+// chunks can't be reordered, dropped, or moved to another stream.
+#define HEADER_SIZE    20
+#define MAC_SIZE       16
+#define MAX_CHUNK_SIZE ((size_t)64 << 20)
+
+// Not a usage error, not a system error either: the input is not
+// something we encrypted with that key.
+static void reject(const char *reason)
+{
+    fprintf(stderr, "Decryption failed: %s\n", reason);
+    exit(3);
+}
+
+static void parse_key(getopt_ctx *ctx, uint8_t key[32])
+{
+    int code = read_buffer(key, 32, getopt_parameter(ctx));
+    if (code == -1) error("unspecified key"             );
+    if (code == -2) error("key too long (32 bytes)"     );
+    if (code == -3) error("key has odd number of digits");
+    if (code == -4) error("key contains non-hex digits" );
+    if (code != 32) error("key too short (32 bytes)"    );
+}
+
+static size_t parse_chunk_size(getopt_ctx *ctx)
+{
+    size_t size;
+    int code = size_of_string(&size, getopt_parameter(ctx));
+    if (code == -1) error("missing chunk size"                          );
+    if (code == -2) error("chunk size must be an integer (suffix K or M)");
+    if (code == -3) error("chunk size too big (64M max)"                );
+    if (size ==  0) error("chunk size must be at least 1 byte"          );
+    if (size > MAX_CHUNK_SIZE) error("chunk size too big (64M max)");
+    return size;
+}
+
+// Reads until the buffer is full, or the input ends.
+// Returns the number of bytes read.  Panics on read errors.
+static size_t read_full(int fd, uint8_t *buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t nb_read = read(fd, buffer + total, size - total);
+        if (nb_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nb_read == -1) {
+            panic("An error occured while reading input");
+        }
+        if (nb_read == 0) {
+            break;
+        }
+        total += (size_t)nb_read;
+    }
+    return total;
+}
+
+// Writes the whole buffer.  Panics on write errors.
+static void write_full(int fd, const uint8_t *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t nb_written = write(fd, buffer, size);
+        if (nb_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nb_written == -1) {
+            panic("An error occured while writing output");
+        }
+        buffer += nb_written;
+        size   -= (size_t)nb_written;
+    }
+}
+
+// Key files hold the raw key (32 bytes), or 64 hex digits followed by
+// an optional line break.  Unlike -k, the key never shows up in the
+// command line of the process.
+static void parse_key_file(getopt_ctx *ctx, uint8_t key[32])
+{
+    const char *file_name = getopt_parameter(ctx);
+    if (file_name == 0) {
+        error("unspecified key file");
+    }
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open key file \"%s\": ", file_name);
+        panic(0);
+    }
+    char   contents[67];  // 64 digits, \r\n, and one more to spot extra data
+    size_t size = read_full(fd, (uint8_t*)contents, sizeof(contents));
+    if (close(fd)) {
+        panic("Could not close key file");
+    }
+    if (size == 32) {
+        memcpy(key, contents, 32);
+    } else {
+        if (size > 0 && contents[size - 1] == '\n') { size--; }
+        if (size > 0 && contents[size - 1] == '\r') { size--; }
+        if (size != 64) {
+            error("key file must hold 32 bytes, or 64 hex digits");
+        }
+        contents[64] = '\0';
+        if (read_buffer(key, 32, contents) != 32) {
+            error("key file contains non-hex digits");
+        }
+    }
+    crypto_wipe(contents, sizeof(contents));
+}
+
+// Nonce and additional data of a chunk
+typedef struct {
+    uint8_t  nonce[24];
+    uint8_t  ad[HEADER_SIZE + 1];
+    uint64_t index;
+} chunk_params;
+
+static void chunk_init(chunk_params *c, const uint8_t header[HEADER_SIZE])
+{
+    for (size_t i = 0; i < 16; i++) {
+        c->nonce[i] = header[i];
+    }
+    for (size_t i = 0; i < HEADER_SIZE; i++) {
+        c->ad[i] = header[i];
+    }
+    c->index = 0;
+}
+
+// Sets the nonce and additional data for the next chunk
+static void chunk_next(chunk_params *c, int is_final)
+{
+    for (size_t i = 0; i < 8; i++) {
+        c->nonce[16 + i] = (uint8_t)(c->index >> (8 * i));
+    }
+    c->ad[HEADER_SIZE] = (uint8_t)is_final;
+    c->index++;
+}
+
+static void encrypt_stream(int in, int out, const uint8_t key[32],
+                           size_t chunk_size)
+{
+    uint8_t header[HEADER_SIZE];
+    random_bytes(header, 16);
+    for (size_t i = 0; i < 4; i++) {
+        header[16 + i] = (uint8_t)(chunk_size >> (8 * i));
+    }
+    write_full(out, header, HEADER_SIZE);
+
+    chunk_params c;
+    chunk_init(&c, header);
+    uint8_t *buffer = alloc(MAC_SIZE + chunk_size);
+    uint8_t *text   = buffer + MAC_SIZE;
+    size_t   size;
+    do {
+        size = read_full(in, text, chunk_size);
+        chunk_next(&c, size < chunk_size);
+        crypto_lock_aead(buffer, text, key, c.nonce,
+                         c.ad, sizeof(c.ad), text, size);
+        write_full(out, buffer, MAC_SIZE + size);
+    } while (size == chunk_size);
+    crypto_wipe(buffer, MAC_SIZE + chunk_size);
+    free(buffer);
+}
+
+static void decrypt_stream(int in, int out, const uint8_t key[32])
+{
+    uint8_t header[HEADER_SIZE];
+    if (read_full(in, header, HEADER_SIZE) < HEADER_SIZE) {
+        reject("input too short");
+    }
+    size_t chunk_size = 0;
+    for (size_t i = 0; i < 4; i++) {
+        chunk_size |= (size_t)header[16 + i] << (8 * i);
+    }
+    if (chunk_size == 0 || chunk_size > MAX_CHUNK_SIZE) {
+        reject("invalid chunk size");
+    }
+
+    chunk_params c;
+    chunk_init(&c, header);
+    uint8_t *buffer = alloc(MAC_SIZE + chunk_size);
+    uint8_t *text   = buffer + MAC_SIZE;
+    size_t   size;
+    do {
+        size = read_full(in, buffer, MAC_SIZE + chunk_size);
+        if (size < MAC_SIZE) {
+            reject("input truncated");
+        }
+        size -= MAC_SIZE;
+        chunk_next(&c, size < chunk_size);
+        // Nothing is written before its chunk is authenticated
+        if (crypto_unlock_aead(text, key, c.nonce, buffer,
+                               c.ad, sizeof(c.ad), text, size)) {
+            reject("corrupted input, or wrong key");
+        }
+        write_full(out, text, size);
+    } while (size == chunk_size);
+    if (read_full(in, buffer, 1) != 0) {
+        reject("trailing data after the last chunk");
+    }
+    crypto_wipe(buffer, MAC_SIZE + chunk_size);
+    free(buffer);
+}
+
+int main(int argc, char* argv[])
+{
+    uint8_t key[32];
+    int     has_key    = 0;
+    int     decrypting = 0;
+    size_t  chunk_size = 64 * 1024;
+
+    set_usage_string(
+        "Usage: encrypt [OPTION]... -K KEY_FILE [FILE]\n"
+        "Encrypt FILE, or decrypt it with -d, to standard output\n"
+        "With no FILE, or when FILE is -, read standard input\n"
+        "\n"
+        "-K --key-file    read the secret key from KEY_FILE: 32 raw\n"
+        "                 bytes, or 64 hex digits.  /dev/fd/N reads\n"
+        "                 it from file descriptor N\n"
+        "-k --key         secret key (32 bytes, in hexadecimal).  Other\n"
+        "                 users can see it (ps, /proc): prefer -K\n"
+        "-d --decrypt     decrypt (and authenticate) instead\n"
+        "-c --chunk-size  encryption: bytes per authenticated chunk,\n"
+        "                 with optional suffix K or M (default 64K,\n"
+        "                 64M max).  Memory use is about one chunk.\n"
+        "-? --help        display this help and exit\n"
+        "\n"
+        "Decrypted chunks are written as soon as they are authenticated.\n"
+        "Exit status is 3 if the input is corrupted, forged, truncated,\n"
+        "or encrypted with another key.  Discard the output then.");
+
+    // Parse and validate arguments
+    getopt_ctx ctx;
+    OPT_BEGIN(ctx, argc, argv);
+    OPT('K', "key-file"  );  parse_key_file(&ctx, key);  has_key = 1;
+    OPT('k', "key"       );  parse_key     (&ctx, key);  has_key = 1;
+    OPT('d', "decrypt"   );  decrypting = 1;
+    OPT('c', "chunk-size");  chunk_size = parse_chunk_size(&ctx);
+    OPT('?', "help"      );  usage();
+    OPT_END;
+    if (!has_key     ) error("missing key");
+    if (ctx.argc >  1) error("Too many arguments");
+
+    int in = STDIN_FILENO;
+    if (ctx.argc == 1 && !string_equal(ctx.argv[0], "-")) {
+        in = open(ctx.argv[0], O_RDONLY);
+        if (in == -1) {
+            fprintf(stderr, "Could not open \"%s\": ", ctx.argv[0]);
+            panic(0);
+        }
+    }
+    if (decrypting) {
+        decrypt_stream(in, STDOUT_FILENO, key);
+    } else {
+        encrypt_stream(in, STDOUT_FILENO, key, chunk_size);
+    }
+    crypto_wipe(key, 32);
+    if (in != STDIN_FILENO && close(in)) {
+        panic("Could not close input");
+    }
+    return 0;
+}
@@ -95,10 +95,19 @@ static int zerocmp32(const u8 p[32])
 
 void crypto_wipe(void *secret, size_t size)
 {
+#ifdef __GNUC__
+    // memset() is much faster than a volatile loop (and uses
+    // non-temporal stores on big buffers).  The empty asm statement
+    // may read the buffer, so the compiler cannot drop the memset().
+    // The builtin needs no header: other compilers keep the loop.
+    __builtin_memset(secret, 0, size);
+    __asm__ __volatile__ ("" : : "r"(secret) : "memory");
+#else
     volatile u8 *v_secret = (u8*)secret;
     FOR (i, 0, size) {
         v_secret[i] = 0;
     }
+#endif
 }
 
 /////////////////
@@ -147,26 +156,20 @@ static void chacha20_init_key(crypto_chacha_ctx *ctx, const u8 key[32])
     }
 }
 
-static u8 chacha20_pool_byte(crypto_chacha_ctx *ctx)
-{
-    u32 pool_word = ctx->pool[ctx->pool_idx >> 2];
-    u8  pool_byte = pool_word >> (8*(ctx->pool_idx & 3));
-    ctx->pool_idx++;
-    return pool_byte;
-}
-
-// Fill the pool if needed, update the counters
+// Fill the pool with the next block of key stream, update the counters
 static void chacha20_refill_pool(crypto_chacha_ctx *ctx)
 {
-    chacha20_rounds(ctx->pool, ctx->input);
+    u32 block[16];
+    chacha20_rounds(block, ctx->input);
     FOR (j, 0, 16) {
-        ctx->pool[j] += ctx->input[j];
+        store32_le(ctx->pool + j*4, block[j] + ctx->input[j]);
     }
     ctx->pool_idx = 0;
     ctx->input[12]++;
     if (ctx->input[12] == 0) {
         ctx->input[13]++;
     }
+    WIPE_BUFFER(block);
 }
 
 void crypto_chacha20_H(u8 out[32], const u8 key[32], const u8 in[16])
@@ -187,25 +190,250 @@ void crypto_chacha20_H(u8 out[32], const u8 key[32], const u8 in[16])
     WIPE_BUFFER(buffer);
 }
 
-static void chacha20_encrypt(crypto_chacha_ctx *ctx,
-                             u8                *cipher_text,
-                             const u8          *plain_text,
-                             size_t             text_size)
+// XORs the input with the key stream, or just copies the key stream if
+// there is no input.  One pass, no per byte branch.
+static void chacha20_xor(u8 *out, const u8 *in, const u8 *stream, size_t size)
 {
-    FOR (i, 0, text_size) {
-        if (ctx->pool_idx == 64) {
-            chacha20_refill_pool(ctx);
+    if (in != 0) {
+        FOR (i, 0, size) {
+            out[i] = in[i] ^ stream[i];
         }
-        u8 plain = 0;
-        if (plain_text != 0) {
-            plain = *plain_text;
-            plain_text++;
+    } else {
+        FOR (i, 0, size) {
+            out[i] = stream[i];
         }
-        *cipher_text = chacha20_pool_byte(ctx) ^ plain;
-        cipher_text++;
     }
 }
 
+// Uses text_size bytes of the pool (no more than what is left)
+static void chacha20_use_pool(crypto_chacha_ctx *ctx,
+                              u8                *cipher_text,
+                              const u8          *plain_text,
+                              size_t             text_size)
+{
+    chacha20_xor(cipher_text, plain_text, ctx->pool + ctx->pool_idx,
+                 text_size);
+    ctx->pool_idx += text_size;
+}
+
+// Several blocks in parallel, one block per vector lane: vector j holds
+// word j of every block.  Only the counter differs from lane to lane.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define CHACHA_LANES 16
+typedef __m512i chacha_vec;
+#define ADD(x, y)   _mm512_add_epi32(x, y)
+#define XOR(x, y)   _mm512_xor_si512(x, y)
+#define SET1(x)     _mm512_set1_epi32((i32)(x))
+#define LOADV(p)    _mm512_loadu_si512(p)
+#define STOREV(p,x) _mm512_storeu_si512(p, x)
+#define ROTL16(x)   _mm512_rol_epi32(x, 16)
+#define ROTL12(x)   _mm512_rol_epi32(x, 12)
+#define ROTL8(x)    _mm512_rol_epi32(x,  8)
+#define ROTL7(x)    _mm512_rol_epi32(x,  7)
+#define ROTL_MASKS
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define CHACHA_LANES 8
+typedef __m256i chacha_vec;
+#define ADD(x, y)   _mm256_add_epi32(x, y)
+#define XOR(x, y)   _mm256_xor_si256(x, y)
+#define SET1(x)     _mm256_set1_epi32((i32)(x))
+#define LOADV(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define STOREV(p,x) _mm256_storeu_si256((__m256i*)(p), x)
+#ifdef __AVX512VL__
+#define ROTL16(x)   _mm256_rol_epi32(x, 16)
+#define ROTL12(x)   _mm256_rol_epi32(x, 12)
+#define ROTL8(x)    _mm256_rol_epi32(x,  8)
+#define ROTL7(x)    _mm256_rol_epi32(x,  7)
+#define ROTL_MASKS
+#else
+#define ROTL16(x)   _mm256_shuffle_epi8(x, r16)
+#define ROTL12(x)   XOR(_mm256_slli_epi32(x, 12), _mm256_srli_epi32(x, 20))
+#define ROTL8(x)    _mm256_shuffle_epi8(x, r8)
+#define ROTL7(x)    XOR(_mm256_slli_epi32(x,  7), _mm256_srli_epi32(x, 25))
+#define ROTL_MASKS                                                      \
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5,        \
+                                         10, 11, 8, 9, 14, 15, 12, 13,  \
+                                         2, 3, 0, 1, 6, 7, 4, 5,        \
+                                         10, 11, 8, 9, 14, 15, 12, 13); \
+    const __m256i r8  = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6,        \
+                                         11, 8, 9, 10, 15, 12, 13, 14,  \
+                                         3, 0, 1, 2, 7, 4, 5, 6,        \
+                                         11, 8, 9, 10, 15, 12, 13, 14)
+#endif
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define CHACHA_LANES 4
+typedef __m128i chacha_vec;
+#define ADD(x, y)   _mm_add_epi32(x, y)
+#define XOR(x, y)   _mm_xor_si128(x, y)
+#define SET1(x)     _mm_set1_epi32((i32)(x))
+#define LOADV(p)    _mm_loadu_si128((const __m128i*)(p))
+#define STOREV(p,x) _mm_storeu_si128((__m128i*)(p), x)
+#define ROTL16(x)   _mm_shuffle_epi8(x, r16)
+#define ROTL12(x)   XOR(_mm_slli_epi32(x, 12), _mm_srli_epi32(x, 20))
+#define ROTL8(x)    _mm_shuffle_epi8(x, r8)
+#define ROTL7(x)    XOR(_mm_slli_epi32(x,  7), _mm_srli_epi32(x, 25))
+#define ROTL_MASKS                                                      \
+    const __m128i r16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5,           \
+                                      10, 11, 8, 9, 14, 15, 12, 13);    \
+    const __m128i r8  = _mm_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6,           \
+                                      11, 8, 9, 10, 15, 12, 13, 14)
+#endif
+
+#ifdef CHACHA_LANES
+#define QUARTERROUND_V(a, b, c, d)                  \
+    a = ADD(a, b);  d = ROTL16(XOR(d, a));          \
+    c = ADD(c, d);  b = ROTL12(XOR(b, c));          \
+    a = ADD(a, b);  d = ROTL8 (XOR(d, a));          \
+    c = ADD(c, d);  b = ROTL7 (XOR(b, c))
+
+// Transposes 4x4 matrices of 32-bit words, one per 128-bit lane.
+// Afterwards, lane k of x[i] holds words 4g to 4g+3 of block 4k+i,
+// where x[0..3] held words 4g to 4g+3 of every block.
+#define TRANSPOSE_4x4(mm, x)                                     \
+    do {                                                         \
+        chacha_vec t0 = mm##_unpacklo_epi32((x)[0], (x)[1]);     \
+        chacha_vec t1 = mm##_unpackhi_epi32((x)[0], (x)[1]);     \
+        chacha_vec t2 = mm##_unpacklo_epi32((x)[2], (x)[3]);     \
+        chacha_vec t3 = mm##_unpackhi_epi32((x)[2], (x)[3]);     \
+        (x)[0] = mm##_unpacklo_epi64(t0, t2);                    \
+        (x)[1] = mm##_unpackhi_epi64(t0, t2);                    \
+        (x)[2] = mm##_unpacklo_epi64(t1, t3);                    \
+        (x)[3] = mm##_unpackhi_epi64(t1, t3);                    \
+    } while (0)
+
+// Stores CHACHA_LANES blocks of key stream, XORed with the input (if
+// any).  Destroys x[].
+static void chacha20_store_lanes(u8 *out, const u8 *in, chacha_vec x[16])
+{
+    FOR (g, 0, 4) {
+#if   defined(__AVX512F__)
+        TRANSPOSE_4x4(_mm512, x + g*4);
+#elif defined(__AVX2__)
+        TRANSPOSE_4x4(_mm256, x + g*4);
+#else
+        TRANSPOSE_4x4(_mm, x + g*4);
+#endif
+    }
+    chacha_vec b[4];
+    FOR (i, 0, 4) {
+        // Gather the 128-bit lanes of block 4k+i, from x[i], x[i+4]...
+#if   defined(__AVX512F__)
+        __m512i t0 = _mm512_shuffle_i32x4(x[i    ], x[i + 4], 0x44);
+        __m512i t1 = _mm512_shuffle_i32x4(x[i    ], x[i + 4], 0xee);
+        __m512i t2 = _mm512_shuffle_i32x4(x[i + 8], x[i + 12], 0x44);
+        __m512i t3 = _mm512_shuffle_i32x4(x[i + 8], x[i + 12], 0xee);
+        b[0] = _mm512_shuffle_i32x4(t0, t2, 0x88); // block i
+        b[1] = _mm512_shuffle_i32x4(t0, t2, 0xdd); // block i + 4
+        b[2] = _mm512_shuffle_i32x4(t1, t3, 0x88); // block i + 8
+        b[3] = _mm512_shuffle_i32x4(t1, t3, 0xdd); // block i + 12
+#define OFFSET(k) ((k*4 + i) * 64)
+#elif defined(__AVX2__)
+        b[0] = _mm256_permute2x128_si256(x[i    ], x[i + 4 ], 0x20);
+        b[1] = _mm256_permute2x128_si256(x[i + 8], x[i + 12], 0x20);
+        b[2] = _mm256_permute2x128_si256(x[i    ], x[i + 4 ], 0x31);
+        b[3] = _mm256_permute2x128_si256(x[i + 8], x[i + 12], 0x31);
+#define OFFSET(k) ((k/2*4 + i) * 64 + k%2 * 32)
+#else
+        FOR (k, 0, 4) {
+            b[k] = x[k*4 + i];
+        }
+#define OFFSET(k) (i * 64 + k * 16)
+#endif
+        FOR (k, 0, 4) {
+            if (in != 0) {
+                b[k] = XOR(b[k], LOADV(in + OFFSET(k)));
+            }
+            STOREV(out + OFFSET(k), b[k]);
+        }
+#undef OFFSET
+    }
+    WIPE_BUFFER(b);
+}
+
+// Encrypts CHACHA_LANES blocks, updates the counter
+static void chacha20_blocks(crypto_chacha_ctx *ctx,
+                            u8 *cipher_text, const u8 *plain_text)
+{
+    ROTL_MASKS;
+    u32 ctr_lo[CHACHA_LANES];
+    u32 ctr_hi[CHACHA_LANES];
+    u64 ctr = ctx->input[12] | ((u64)ctx->input[13] << 32);
+    FOR (i, 0, CHACHA_LANES) {
+        ctr_lo[i] = (u32)(ctr + i);
+        ctr_hi[i] = (u32)((ctr + i) >> 32);
+    }
+    ctr += CHACHA_LANES;
+    ctx->input[12] = ctr & 0xffffffff;
+    ctx->input[13] = ctr >> 32;
+
+    chacha_vec in[16];
+    chacha_vec x [16];
+    FOR (j, 0, 16) {
+        in[j] = SET1(ctx->input[j]);
+    }
+    in[12] = LOADV(ctr_lo);
+    in[13] = LOADV(ctr_hi);
+    FOR (j, 0, 16) {
+        x[j] = in[j];
+    }
+    FOR (i, 0, 10) { // 20 rounds, 2 rounds per loop.
+        QUARTERROUND_V(x[0], x[4], x[ 8], x[12]); // column 0
+        QUARTERROUND_V(x[1], x[5], x[ 9], x[13]); // column 1
+        QUARTERROUND_V(x[2], x[6], x[10], x[14]); // column 2
+        QUARTERROUND_V(x[3], x[7], x[11], x[15]); // column 3
+        QUARTERROUND_V(x[0], x[5], x[10], x[15]); // diagonal 0
+        QUARTERROUND_V(x[1], x[6], x[11], x[12]); // diagonal 1
+        QUARTERROUND_V(x[2], x[7], x[ 8], x[13]); // diagonal 2
+        QUARTERROUND_V(x[3], x[4], x[ 9], x[14]); // diagonal 3
+    }
+    FOR (j, 0, 16) {
+        x[j] = ADD(x[j], in[j]);
+    }
+    chacha20_store_lanes(cipher_text, plain_text, x);
+    WIPE_BUFFER(in);
+    WIPE_BUFFER(x);
+}
+
+// Encrypts the last text_size bytes of the message, with a single (and
+// partially wasted) batch of blocks: past one block, this is still
+// faster than the scalar code.  What remains of the last block goes
+// to the pool.  text_size must not exceed CHACHA_LANES * 64.
+static void chacha20_last_blocks(crypto_chacha_ctx *ctx,
+                                 u8                *cipher_text,
+                                 const u8          *plain_text,
+                                 size_t             text_size)
+{
+    u8     stream[CHACHA_LANES * 64];
+    u64    ctr       = ctx->input[12] | ((u64)ctx->input[13] << 32);
+    size_t nb_blocks = (text_size + 63) >> 6;
+    size_t last      = (nb_blocks - 1) * 64;
+    chacha20_blocks(ctx, stream, 0);
+    chacha20_xor(cipher_text, plain_text, stream, text_size);
+    FOR (i, 0, 64) {
+        ctx->pool[i] = stream[last + i];
+    }
+    ctx->pool_idx  = text_size - last;
+    ctx->input[12] = (ctr + nb_blocks) & 0xffffffff;
+    ctx->input[13] = (ctr + nb_blocks) >> 32;
+    WIPE_BUFFER(stream);
+}
+#undef QUARTERROUND_V
+#undef TRANSPOSE_4x4
+#undef ADD
+#undef XOR
+#undef SET1
+#undef LOADV
+#undef STOREV
+#undef ROTL16
+#undef ROTL12
+#undef ROTL8
+#undef ROTL7
+#undef ROTL_MASKS
+#endif // CHACHA_LANES
+
 void crypto_chacha20_init(crypto_chacha_ctx *ctx,
                           const u8           key[32],
                           const u8           nonce[8])
@@ -238,37 +466,47 @@ void crypto_chacha20_encrypt(crypto_chacha_ctx *ctx,
                              const u8          *plain_text,
                              size_t             text_size)
 {
-    // Align ourselves with block boundaries
+    // Use what is left of the pool first
     size_t align = MIN(ALIGN(ctx->pool_idx, 64), text_size);
-    chacha20_encrypt(ctx, cipher_text, plain_text, align);
+    chacha20_use_pool(ctx, cipher_text, plain_text, align);
     if (plain_text != 0) {
         plain_text += align;
     }
     cipher_text += align;
     text_size   -= align;
 
+#ifdef CHACHA_LANES
+    // Process the message several blocks at a time
+    while (text_size >= CHACHA_LANES * 64) {
+        chacha20_blocks(ctx, cipher_text, plain_text);
+        if (plain_text != 0) {
+            plain_text += CHACHA_LANES * 64;
+        }
+        cipher_text += CHACHA_LANES * 64;
+        text_size   -= CHACHA_LANES * 64;
+    }
+    if (text_size > 64) {
+        chacha20_last_blocks(ctx, cipher_text, plain_text, text_size);
+        return;
+    }
+#endif
+
     // Process the message block by block
     FOR (i, 0, text_size >> 6) {  // number of blocks
         chacha20_refill_pool(ctx);
+        chacha20_use_pool(ctx, cipher_text, plain_text, 64);
         if (plain_text != 0) {
-            FOR (j, 0, 16) {
-                u32 plain = load32_le(plain_text);
-                store32_le(cipher_text, ctx->pool[j] ^ plain);
-                plain_text  += 4;
-                cipher_text += 4;
-            }
-        } else {
-            FOR (j, 0, 16) {
-                store32_le(cipher_text, ctx->pool[j]);
-                cipher_text += 4;
-            }
+            plain_text += 64;
         }
-        ctx->pool_idx = 64;
+        cipher_text += 64;
     }
     text_size &= 63;
 
     // remaining bytes
-    chacha20_encrypt(ctx, cipher_text, plain_text, text_size);
+    if (text_size > 0) {
+        chacha20_refill_pool(ctx);
+        chacha20_use_pool(ctx, cipher_text, plain_text, text_size);
+    }
 }
 
 void crypto_chacha20_stream(crypto_chacha_ctx *ctx,
@@ -331,6 +569,230 @@ static void poly_block(crypto_poly1305_ctx *ctx)
     ctx->h[4] = (u32)u4;         // u4 <=          4
 }
 
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 u128;
+
+// Same as poly_block(), over nb_blocks full blocks of the message, with
+// 64-bit limbs: h = h0 + h1 * 2^64 + h2 * 2^128, r = r0 + r1 * 2^64.
+// Same preconditions and postcondition (h2 <= 4).
+static void poly_blocks(crypto_poly1305_ctx *ctx,
+                        const u8 *message, size_t nb_blocks)
+{
+    const u64 r0  = ctx->r[0] | ((u64)ctx->r[1] << 32); // <= 0ffffffc_0fffffff
+    const u64 r1  = ctx->r[2] | ((u64)ctx->r[3] << 32); // <= 0ffffffc_0ffffffc
+    const u64 rr1 = (r1 >> 2) + r1;                     // == (r1 >> 2) * 5
+    u64 h0 = ctx->h[0] | ((u64)ctx->h[1] << 32);
+    u64 h1 = ctx->h[2] | ((u64)ctx->h[3] << 32);
+    u64 h2 = ctx->h[4];                                 // h2 <= 4
+    FOR (i, 0, nb_blocks) {
+        // h + c, with carry propagation (the block is full: c4 = 1)
+        u128 s0 = (u128)h0 + load64_le(message    );
+        u128 s1 = (u128)h1 + load64_le(message + 8) + (u64)(s0 >> 64);
+        const u64 s2 = h2 + (u64)(s1 >> 64) + 1; // s2 <= 6
+        h0 = (u64)s0;
+        h1 = (u64)s1;
+
+        // (h + c) * r, without carry propagation
+        const u128 x0 = (u128)h0 * r0 + (u128)h1 * rr1;
+        const u128 x1 = (u128)h0 * r1 + (u128)h1 * r0 + (u128)s2 * rr1;
+        const u64  x2 = s2 * r0 + (u64)(x1 >> 64);
+
+        // partial reduction modulo 2^130 - 5
+        const u128 u0 = (u128)(x2 >> 2) * 5 + (u64)x0;
+        const u128 u1 = (u0 >> 64) + (u64)x1 + (u64)(x0 >> 64);
+        h0 = (u64)u0;
+        h1 = (u64)u1;
+        h2 = (x2 & 3) + (u64)(u1 >> 64);         // h2 <= 4
+        message += 16;
+    }
+    ctx->h[0] = (u32)h0;  ctx->h[1] = (u32)(h0 >> 32);
+    ctx->h[2] = (u32)h1;  ctx->h[3] = (u32)(h1 >> 32);
+    ctx->h[4] = (u32)h2;
+}
+#endif // __SIZEOF_INT128__
+
+// 4 blocks in parallel (AVX2), with 26-bit limbs.  Vector i holds limb
+// i of 4 separate hashes: each lane multiplies by r^4, and the lanes are
+// combined at the end (multiplied by r^4, r^3, r^2, and r).
+#if defined(__AVX2__) && defined(__SIZEOF_INT128__)
+#include <immintrin.h>
+
+#define MASK26    0x3ffffff
+#define ADD(x, y) _mm256_add_epi64(x, y)
+
+// out = a * b (mod 2^130 - 5), partially reduced, 26-bit limbs
+static void poly_mul26(u64 out[5], const u64 a[5], const u64 b[5])
+{
+    u64 bb[5];
+    FOR (i, 0, 5) {
+        bb[i] = b[i] * 5;
+    }
+    u64 d[5];
+    d[0] = a[0]*b[0] + a[1]*bb[4] + a[2]*bb[3] + a[3]*bb[2] + a[4]*bb[1];
+    d[1] = a[0]*b[1] + a[1]*b[0]  + a[2]*bb[4] + a[3]*bb[3] + a[4]*bb[2];
+    d[2] = a[0]*b[2] + a[1]*b[1]  + a[2]*b[0]  + a[3]*bb[4] + a[4]*bb[3];
+    d[3] = a[0]*b[3] + a[1]*b[2]  + a[2]*b[1]  + a[3]*b[0]  + a[4]*bb[4];
+    d[4] = a[0]*b[4] + a[1]*b[3]  + a[2]*b[2]  + a[3]*b[1]  + a[4]*b[0];
+    FOR (i, 0, 4) {
+        d[i+1] += d[i] >> 26;
+        d[i  ] &= MASK26;
+    }
+    d[0] += (d[4] >> 26) * 5;
+    d[4] &= MASK26;
+    d[1] += d[0] >> 26;
+    d[0] &= MASK26;
+    FOR (i, 0, 5) {
+        out[i] = d[i];
+    }
+}
+
+// a = a * r (mod 2^130 - 5), partially reduced, in each lane.
+// rr = r * 5.  Limbs stay below 2^26 + 2^12 or so.
+static void poly_mul_x4(__m256i a[5], const __m256i r[5], const __m256i rr[5])
+{
+#define MUL(x, y) _mm256_mul_epu32(x, y)
+    __m256i d0 = ADD(ADD(ADD(ADD(MUL(a[0], r [0]), MUL(a[1], rr[4])),
+                             MUL(a[2], rr[3])), MUL(a[3], rr[2])),
+                     MUL(a[4], rr[1]));
+    __m256i d1 = ADD(ADD(ADD(ADD(MUL(a[0], r [1]), MUL(a[1], r [0])),
+                             MUL(a[2], rr[4])), MUL(a[3], rr[3])),
+                     MUL(a[4], rr[2]));
+    __m256i d2 = ADD(ADD(ADD(ADD(MUL(a[0], r [2]), MUL(a[1], r [1])),
+                             MUL(a[2], r [0])), MUL(a[3], rr[4])),
+                     MUL(a[4], rr[3]));
+    __m256i d3 = ADD(ADD(ADD(ADD(MUL(a[0], r [3]), MUL(a[1], r [2])),
+                             MUL(a[2], r [1])), MUL(a[3], r [0])),
+                     MUL(a[4], rr[4]));
+    __m256i d4 = ADD(ADD(ADD(ADD(MUL(a[0], r [4]), MUL(a[1], r [3])),
+                             MUL(a[2], r [2])), MUL(a[3], r [1])),
+                     MUL(a[4], r [0]));
+    // Two interleaved carry chains, the second one wrapping around
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    __m256i c;
+#define CARRY(x, y)                                     \
+    c = _mm256_srli_epi64(x, 26);                       \
+    x = _mm256_and_si256(x, mask);                      \
+    y = ADD(y, c)
+    CARRY(d0, d1);
+    CARRY(d3, d4);
+    CARRY(d1, d2);
+    c  = _mm256_srli_epi64(d4, 26);
+    d4 = _mm256_and_si256(d4, mask);
+    d0 = ADD(d0, ADD(c, _mm256_slli_epi64(c, 2))); // c * 5
+    CARRY(d2, d3);
+    CARRY(d0, d1);
+    CARRY(d3, d4);
+#undef CARRY
+#undef MUL
+    a[0] = d0;  a[1] = d1;  a[2] = d2;  a[3] = d3;  a[4] = d4;
+}
+
+// Adds 4 message blocks to a (one per lane), block i goes to lane
+// (0, 2, 1, 3)[i]: the order in which unpacking leaves them.
+static void poly_add_x4(__m256i a[5], const u8 *message)
+{
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    __m256i b01 = _mm256_loadu_si256((const __m256i*)(message     ));
+    __m256i b23 = _mm256_loadu_si256((const __m256i*)(message + 32));
+    __m256i lo  = _mm256_unpacklo_epi64(b01, b23);
+    __m256i hi  = _mm256_unpackhi_epi64(b01, b23);
+    __m256i m[5];
+    m[0] = _mm256_and_si256(lo, mask);
+    m[1] = _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask);
+    m[2] = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52),
+                                            _mm256_slli_epi64(hi, 12)),
+                            mask);
+    m[3] = _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask);
+    m[4] = _mm256_or_si256(_mm256_srli_epi64(hi, 40),
+                           _mm256_set1_epi64x(1 << 24)); // c4 = 1
+    FOR (i, 0, 5) {
+        a[i] = ADD(a[i], m[i]);
+    }
+}
+
+// Same as poly_blocks(), nb_blocks must be a non-zero multiple of 4.
+static void poly_blocks_x4(crypto_poly1305_ctx *ctx,
+                           const u8 *message, size_t nb_blocks)
+{
+    // r, r^2, r^3, r^4
+    u64 r[4][5];
+    u128 r128 = ctx->r[0]
+        | ((u128)ctx->r[1] << 32)
+        | ((u128)ctx->r[2] << 64)
+        | ((u128)ctx->r[3] << 96);
+    FOR (i, 0, 5) {
+        r[0][i] = (u64)(r128 >> (26 * i)) & MASK26;
+    }
+    FOR (i, 1, 4) {
+        poly_mul26(r[i], r[i-1], r[0]);
+    }
+
+    // Start with h in the first lane
+    u128 h128 = ctx->h[0]
+        | ((u128)ctx->h[1] << 32)
+        | ((u128)ctx->h[2] << 64)
+        | ((u128)ctx->h[3] << 96);
+    __m256i a[5];
+    FOR (i, 0, 4) {
+        a[i] = _mm256_setr_epi64x((u64)(h128 >> (26 * i)) & MASK26, 0, 0, 0);
+    }
+    a[4] = _mm256_setr_epi64x((u64)(h128 >> 104)
+                              | ((u64)ctx->h[4] << 24), 0, 0, 0);
+    poly_add_x4(a, message);
+
+    __m256i r4[5];
+    __m256i rr4[5];
+    FOR (i, 0, 5) {
+        r4 [i] = _mm256_set1_epi64x(r[3][i]);
+        rr4[i] = _mm256_set1_epi64x(r[3][i] * 5);
+    }
+    FOR (i, 1, nb_blocks >> 2) {
+        poly_mul_x4(a, r4, rr4);
+        poly_add_x4(a, message + i*64);
+    }
+
+    // Last multiplication, by r^4, r^3, r^2, and r for blocks 0, 1, 2,
+    // and 3 (lanes 0, 2, 1, 3), then sum the lanes.
+    __m256i rn [5];
+    __m256i rrn[5];
+    FOR (i, 0, 5) {
+        rn [i] = _mm256_setr_epi64x(r[3][i], r[1][i], r[2][i], r[0][i]);
+        rrn[i] = _mm256_setr_epi64x(r[3][i] * 5, r[1][i] * 5,
+                                    r[2][i] * 5, r[0][i] * 5);
+    }
+    poly_mul_x4(a, rn, rrn);
+    u64 d[5];
+    FOR (i, 0, 5) {
+        u64 lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, a[i]);
+        d[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    FOR (i, 0, 4) {
+        d[i+1] += d[i] >> 26;
+        d[i  ] &= MASK26;
+    }
+    d[0] += (d[4] >> 26) * 5;
+    d[4] &= MASK26;
+    FOR (i, 0, 4) {
+        d[i+1] += d[i] >> 26;
+        d[i  ] &= MASK26;
+    } // d[4] <= 4_ffffff
+    h128 = d[0]
+        | ((u128)d[1] << 26)
+        | ((u128)d[2] << 52)
+        | ((u128)d[3] << 78)
+        | ((u128)d[4] << 104);
+    ctx->h[0] = (u32)(h128      );
+    ctx->h[1] = (u32)(h128 >> 32);
+    ctx->h[2] = (u32)(h128 >> 64);
+    ctx->h[3] = (u32)(h128 >> 96);
+    ctx->h[4] = (u32)(d[4] >> 24);
+    WIPE_BUFFER(r);
+}
+#undef ADD
+#undef MASK26
+#endif // __AVX2__
+
 // (re-)initializes the input counter and input buffer
 static void poly_clear_c(crypto_poly1305_ctx *ctx)
 {
@@ -387,6 +849,18 @@ void crypto_poly1305_update(crypto_poly1305_ctx *ctx,
 
     // Process the message block by block
     size_t nb_blocks = message_size >> 4;
+#if defined(__AVX2__) && defined(__SIZEOF_INT128__)
+    if (nb_blocks >= 16) { // 4 blocks at a time
+        size_t nb_x4 = nb_blocks & ~(size_t)3;
+        poly_blocks_x4(ctx, message, nb_x4);
+        message   += nb_x4 * 16;
+        nb_blocks -= nb_x4;
+    }
+#endif
+#ifdef __SIZEOF_INT128__
+    poly_blocks(ctx, message, nb_blocks);
+    message += nb_blocks * 16;
+#else
     FOR (i, 0, nb_blocks) {
         ctx->c[0] = load32_le(message +  0);
         ctx->c[1] = load32_le(message +  4);
@@ -398,6 +872,7 @@ void crypto_poly1305_update(crypto_poly1305_ctx *ctx,
     if (nb_blocks > 0) {
         poly_clear_c(ctx);
     }
+#endif
     message_size &= 15;
 
     // remaining bytes
@@ -459,31 +934,35 @@ static const u64 iv[8] = {
 };
 
 // increment the input offset
-static void blake2b_incr(crypto_blake2b_ctx *ctx)
+static void blake2b_incr(crypto_blake2b_ctx *ctx, size_t size)
 {
-    u64   *x = ctx->input_offset;
-    size_t y = ctx->input_idx;
-    x[0] += y;
-    if (x[0] < y) {
+    u64 *x = ctx->input_offset;
+    x[0] += size;
+    if (x[0] < size) {
         x[1]++;
     }
 }
 
-static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
-{
-    static const u8 sigma[12][16] = {
-        {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
-        { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
-        { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
-        {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
-        {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
-        {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
-        { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
-        { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
-        {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
-        { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
-    };
+static const u8 sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+};
 
+// Stays scalar: one block is a chain of dependent G functions, and a
+// wide core already runs the 4 independent ones in parallel.  SSE4.1
+// and AVX2 versions of it were slower.  Vectors pay off across several
+// blocks at once instead (see blake2b_compress_x4 and _x8 below).
+static void blake2b_compress(crypto_blake2b_ctx *ctx, const u8 block[128],
+                             int is_last_block)
+{
     // init work vector
     u64 v0 = ctx->hash[0];  u64 v8  = iv[0];
     u64 v1 = ctx->hash[1];  u64 v9  = iv[1];
@@ -492,24 +971,25 @@ static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
     u64 v4 = ctx->hash[4];  u64 v12 = iv[4] ^ ctx->input_offset[0];
     u64 v5 = ctx->hash[5];  u64 v13 = iv[5] ^ ctx->input_offset[1];
     u64 v6 = ctx->hash[6];  u64 v14 = iv[6] ^ is_last_block;
-    u64 v7 = ctx->hash[7];  u64 v15 = iv[7];
+    u64 v7 = ctx->hash[7];  u64 v15 = iv[7] ^ (ctx->last_node & is_last_block);
 
     // mangle work vector
-    uint64_t *input = ctx->input;
+    // (message words are loaded straight from the block, as needed)
+#define M(i, j) load64_le(block + sigma[i][j] * 8)
 #define BLAKE2_G(v, a, b, c, d, x, y)                  \
     v##a += v##b + x;  v##d = rotr64(v##d ^ v##a, 32); \
     v##c += v##d;      v##b = rotr64(v##b ^ v##c, 24); \
     v##a += v##b + y;  v##d = rotr64(v##d ^ v##a, 16); \
     v##c += v##d;      v##b = rotr64(v##b ^ v##c, 63);
-#define BLAKE2_ROUND(i)                                                 \
-    BLAKE2_G(v, 0, 4,  8, 12, input[sigma[i][ 0]], input[sigma[i][ 1]]);\
-    BLAKE2_G(v, 1, 5,  9, 13, input[sigma[i][ 2]], input[sigma[i][ 3]]);\
-    BLAKE2_G(v, 2, 6, 10, 14, input[sigma[i][ 4]], input[sigma[i][ 5]]);\
-    BLAKE2_G(v, 3, 7, 11, 15, input[sigma[i][ 6]], input[sigma[i][ 7]]);\
-    BLAKE2_G(v, 0, 5, 10, 15, input[sigma[i][ 8]], input[sigma[i][ 9]]);\
-    BLAKE2_G(v, 1, 6, 11, 12, input[sigma[i][10]], input[sigma[i][11]]);\
-    BLAKE2_G(v, 2, 7,  8, 13, input[sigma[i][12]], input[sigma[i][13]]);\
-    BLAKE2_G(v, 3, 4,  9, 14, input[sigma[i][14]], input[sigma[i][15]])
+#define BLAKE2_ROUND(i)                                     \
+    BLAKE2_G(v, 0, 4,  8, 12, M(i,  0), M(i,  1));          \
+    BLAKE2_G(v, 1, 5,  9, 13, M(i,  2), M(i,  3));          \
+    BLAKE2_G(v, 2, 6, 10, 14, M(i,  4), M(i,  5));          \
+    BLAKE2_G(v, 3, 7, 11, 15, M(i,  6), M(i,  7));          \
+    BLAKE2_G(v, 0, 5, 10, 15, M(i,  8), M(i,  9));          \
+    BLAKE2_G(v, 1, 6, 11, 12, M(i, 10), M(i, 11));          \
+    BLAKE2_G(v, 2, 7,  8, 13, M(i, 12), M(i, 13));          \
+    BLAKE2_G(v, 3, 4,  9, 14, M(i, 14), M(i, 15))
 
     BLAKE2_ROUND(0);  BLAKE2_ROUND(1);  BLAKE2_ROUND(2);  BLAKE2_ROUND(3);
     BLAKE2_ROUND(4);  BLAKE2_ROUND(5);  BLAKE2_ROUND(6);  BLAKE2_ROUND(7);
@@ -525,52 +1005,293 @@ static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
     ctx->hash[6] ^= v6 ^ v14;
     ctx->hash[7] ^= v7 ^ v15;
 }
+#undef M
+#undef BLAKE2_G
+#undef BLAKE2_ROUND
+
+// Multi-buffer compression: compresses one block for each of several
+// contexts at once.  Word i of every context goes in the same vector,
+// one context per lane, so the G functions are the same as the scalar
+// ones, only wider.  All lanes share the same is_last_block flag.
+#define LANE_G(a, b, c, d, x, y)                                 \
+    v[a] = ADD(ADD(v[a], m[x]), v[b]);  v[d] = ROTR32(XOR(v[d], v[a])); \
+    v[c] = ADD(v[c], v[d]);             v[b] = ROTR24(XOR(v[b], v[c])); \
+    v[a] = ADD(ADD(v[a], m[y]), v[b]);  v[d] = ROTR16(XOR(v[d], v[a])); \
+    v[c] = ADD(v[c], v[d]);             v[b] = ROTR63(XOR(v[b], v[c]))
+#define LANE_ROUND(i)                                                   \
+    LANE_G(0, 4,  8, 12, sigma[i][ 0], sigma[i][ 1]);                   \
+    LANE_G(1, 5,  9, 13, sigma[i][ 2], sigma[i][ 3]);                   \
+    LANE_G(2, 6, 10, 14, sigma[i][ 4], sigma[i][ 5]);                   \
+    LANE_G(3, 7, 11, 15, sigma[i][ 6], sigma[i][ 7]);                   \
+    LANE_G(0, 5, 10, 15, sigma[i][ 8], sigma[i][ 9]);                   \
+    LANE_G(1, 6, 11, 12, sigma[i][10], sigma[i][11]);                   \
+    LANE_G(2, 7,  8, 13, sigma[i][12], sigma[i][13]);                   \
+    LANE_G(3, 4,  9, 14, sigma[i][14], sigma[i][15])
+#define LANE_ROUNDS                                                     \
+    LANE_ROUND(0);  LANE_ROUND(1);  LANE_ROUND(2);  LANE_ROUND(3);      \
+    LANE_ROUND(4);  LANE_ROUND(5);  LANE_ROUND(6);  LANE_ROUND(7);      \
+    LANE_ROUND(8);  LANE_ROUND(9);  LANE_ROUND(0);  LANE_ROUND(1)
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+#define ADD(x, y) _mm256_add_epi64(x, y)
+#define XOR(x, y) _mm256_xor_si256(x, y)
+#ifdef __AVX512VL__
+#define ROTR32(x) _mm256_ror_epi64(x, 32)
+#define ROTR24(x) _mm256_ror_epi64(x, 24)
+#define ROTR16(x) _mm256_ror_epi64(x, 16)
+#define ROTR63(x) _mm256_ror_epi64(x, 63)
+#else
+#define ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8(x, r24)
+#define ROTR16(x) _mm256_shuffle_epi8(x, r16)
+#define ROTR63(x) XOR(_mm256_srli_epi64(x, 63), ADD(x, x))
+#endif
 
-static void blake2b_set_input(crypto_blake2b_ctx *ctx, u8 input, size_t index)
+// Transposes a 4x4 matrix of 64-bit words (4 rows of 4 words).
+// sha512.c has a copy (sha512_transpose_x4()).
+static void transpose_x4(__m256i out[4], const __m256i in[4])
 {
-    if (index == 0) {
-        FOR (i, 0, 16) {
-            ctx->input[i] = 0;
-        }
+    __m256i t0 = _mm256_unpacklo_epi64(in[0], in[1]);
+    __m256i t1 = _mm256_unpackhi_epi64(in[0], in[1]);
+    __m256i t2 = _mm256_unpacklo_epi64(in[2], in[3]);
+    __m256i t3 = _mm256_unpackhi_epi64(in[2], in[3]);
+    out[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+    out[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+    out[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+    out[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+// Loads words [offset, offset+4[ of 4 buffers, one buffer per lane
+static void load_x4(__m256i out[4], const u8 *in[4], size_t offset)
+{
+    __m256i rows[4];
+    FOR (i, 0, 4) {
+        rows[i] = _mm256_loadu_si256((const __m256i*)(in[i] + offset * 8));
     }
-    size_t word = index >> 3;
-    size_t byte = index & 7;
-    ctx->input[word] |= (u64)input << (byte << 3);
+    transpose_x4(out, rows);
+}
 
+static void blake2b_compress_x4(crypto_blake2b_ctx ctx[4], const u8 *block[4],
+                                int is_last_block)
+{
+#ifndef __AVX512VL__
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10);
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9);
+#endif
+    // load message
+    __m256i m[16];
+    FOR (i, 0, 4) {
+        load_x4(m + i*4, block, i*4);
+    }
+
+    // init work vector
+    const u8 *hash[4];
+    u64       offset[2][4];
+    u64       last_node[4];
+    FOR (i, 0, 4) {
+        hash     [i]    = (const u8*)ctx[i].hash;
+        offset   [0][i] = ctx[i].input_offset[0];
+        offset   [1][i] = ctx[i].input_offset[1];
+        last_node[i]    = ctx[i].last_node & is_last_block;
+    }
+    __m256i v[16];
+    __m256i h[8];
+    load_x4(h    , hash, 0);
+    load_x4(h + 4, hash, 4);
+    FOR (i, 0, 8) {
+        v[i  ] = h[i];
+        v[i+8] = _mm256_set1_epi64x((i64)iv[i]);
+    }
+    v[12] = XOR(v[12], _mm256_loadu_si256((const __m256i*)offset[0]));
+    v[13] = XOR(v[13], _mm256_loadu_si256((const __m256i*)offset[1]));
+    v[14] = XOR(v[14], _mm256_set1_epi64x((i64)is_last_block));
+    v[15] = XOR(v[15], _mm256_loadu_si256((const __m256i*)last_node));
+
+    // mangle work vector
+    LANE_ROUNDS;
+
+    // update hash
+    FOR (i, 0, 8) {
+        h[i] = XOR(h[i], XOR(v[i], v[i+8]));
+    }
+    __m256i out[4];
+    FOR (j, 0, 2) {
+        transpose_x4(out, h + j*4);
+        FOR (i, 0, 4) {
+            _mm256_storeu_si256((__m256i*)(ctx[i].hash + j*4), out[i]);
+        }
+    }
+}
+#undef ADD
+#undef XOR
+#undef ROTR32
+#undef ROTR24
+#undef ROTR16
+#undef ROTR63
+#endif // __AVX2__
+
+#ifdef __AVX512F__
+#define ADD(x, y) _mm512_add_epi64(x, y)
+#define XOR(x, y) _mm512_xor_si512(x, y)
+#define ROTR32(x) _mm512_ror_epi64(x, 32)
+#define ROTR24(x) _mm512_ror_epi64(x, 24)
+#define ROTR16(x) _mm512_ror_epi64(x, 16)
+#define ROTR63(x) _mm512_ror_epi64(x, 63)
+
+// Transposes an 8x8 matrix of 64-bit words (8 rows of 8 words).
+// sha512.c has a copy (sha512_transpose_x8()).
+static void transpose_x8(__m512i out[8], const __m512i in[8])
+{
+    __m512i t[8];
+    __m512i u[8];
+    FOR (i, 0, 4) {
+        t[i*2    ] = _mm512_unpacklo_epi64(in[i*2], in[i*2 + 1]);
+        t[i*2 + 1] = _mm512_unpackhi_epi64(in[i*2], in[i*2 + 1]);
+    }
+    FOR (i, 0, 2) { // rows 4i to 4i+3, gathered by pairs of words
+        const __m512i *ti = t + i*4;
+        u[i*4    ] = _mm512_shuffle_i64x2(ti[0], ti[2], 0x88); // words 0, 4
+        u[i*4 + 1] = _mm512_shuffle_i64x2(ti[0], ti[2], 0xdd); // words 2, 6
+        u[i*4 + 2] = _mm512_shuffle_i64x2(ti[1], ti[3], 0x88); // words 1, 5
+        u[i*4 + 3] = _mm512_shuffle_i64x2(ti[1], ti[3], 0xdd); // words 3, 7
+    }
+    out[0] = _mm512_shuffle_i64x2(u[0], u[4], 0x88);
+    out[4] = _mm512_shuffle_i64x2(u[0], u[4], 0xdd);
+    out[2] = _mm512_shuffle_i64x2(u[1], u[5], 0x88);
+    out[6] = _mm512_shuffle_i64x2(u[1], u[5], 0xdd);
+    out[1] = _mm512_shuffle_i64x2(u[2], u[6], 0x88);
+    out[5] = _mm512_shuffle_i64x2(u[2], u[6], 0xdd);
+    out[3] = _mm512_shuffle_i64x2(u[3], u[7], 0x88);
+    out[7] = _mm512_shuffle_i64x2(u[3], u[7], 0xdd);
 }
 
-static void blake2b_end_block(crypto_blake2b_ctx *ctx)
+// Loads words [offset, offset+8[ of 8 buffers, one buffer per lane
+static void load_x8(__m512i out[8], const u8 *in[8], size_t offset)
 {
-    if (ctx->input_idx == 128) {  // If buffer is full,
-        blake2b_incr(ctx);        // update the input offset
-        blake2b_compress(ctx, 0); // and compress the (not last) block
-        ctx->input_idx = 0;
+    __m512i rows[8];
+    FOR (i, 0, 8) {
+        rows[i] = _mm512_loadu_si512(in[i] + offset * 8);
     }
+    transpose_x8(out, rows);
 }
 
-static void blake2b_update(crypto_blake2b_ctx *ctx,
-                           const u8 *message, size_t message_size)
+static void blake2b_compress_x8(crypto_blake2b_ctx ctx[8], const u8 *block[8],
+                                int is_last_block)
 {
-    FOR (i, 0, message_size) {
-        blake2b_end_block(ctx);
-        blake2b_set_input(ctx, message[i], ctx->input_idx);
-        ctx->input_idx++;
+    // load message
+    __m512i m[16];
+    load_x8(m    , block, 0);
+    load_x8(m + 8, block, 8);
+
+    // init work vector
+    const u8 *hash[8];
+    u64       offset[2][8];
+    u64       last_node[8];
+    FOR (i, 0, 8) {
+        hash     [i]    = (const u8*)ctx[i].hash;
+        offset   [0][i] = ctx[i].input_offset[0];
+        offset   [1][i] = ctx[i].input_offset[1];
+        last_node[i]    = ctx[i].last_node & is_last_block;
+    }
+    __m512i v[16];
+    __m512i h[8];
+    load_x8(h, hash, 0);
+    FOR (i, 0, 8) {
+        v[i  ] = h[i];
+        v[i+8] = _mm512_set1_epi64((i64)iv[i]);
+    }
+    v[12] = XOR(v[12], _mm512_loadu_si512(offset[0]));
+    v[13] = XOR(v[13], _mm512_loadu_si512(offset[1]));
+    v[14] = XOR(v[14], _mm512_set1_epi64((i64)is_last_block));
+    v[15] = XOR(v[15], _mm512_loadu_si512(last_node));
+
+    // mangle work vector
+    LANE_ROUNDS;
+
+    // update hash
+    FOR (i, 0, 8) {
+        h[i] = XOR(h[i], XOR(v[i], v[i+8]));
+    }
+    __m512i out[8];
+    transpose_x8(out, h);
+    FOR (i, 0, 8) {
+        _mm512_storeu_si512(ctx[i].hash, out[i]);
+    }
+}
+#undef ADD
+#undef XOR
+#undef ROTR32
+#undef ROTR24
+#undef ROTR16
+#undef ROTR63
+#endif // __AVX512F__
+#undef LANE_G
+#undef LANE_ROUND
+#undef LANE_ROUNDS
+
+// Compresses one block for each of the nb_lanes contexts, using the
+// widest kernel available, and the scalar version for the rest.
+static void blake2b_compress_lanes(crypto_blake2b_ctx *ctx, const u8 *block[],
+                                   size_t nb_lanes, int is_last_block)
+{
+    size_t i = 0;
+#ifdef __AVX512F__
+    for (; i + 8 <= nb_lanes; i += 8) {
+        blake2b_compress_x8(ctx + i, block + i, is_last_block);
+    }
+#endif
+#ifdef __AVX2__
+    for (; i + 4 <= nb_lanes; i += 4) {
+        blake2b_compress_x4(ctx + i, block + i, is_last_block);
+    }
+#endif
+    for (; i < nb_lanes; i++) {
+        blake2b_compress(ctx + i, block[i], is_last_block);
     }
 }
 
-void crypto_blake2b_general_init(crypto_blake2b_ctx *ctx, size_t hash_size,
-                                 const u8           *key, size_t key_size)
+// Compresses a full block, known not to be the last one
+static void blake2b_compress_block(crypto_blake2b_ctx *ctx, const u8 *block)
+{
+    blake2b_incr(ctx, 128);
+    blake2b_compress(ctx, block, 0);
+}
+
+void crypto_blake2b_tree_init(crypto_blake2b_ctx *ctx, size_t hash_size,
+                              u8  fanout     , u8  depth, u32 leaf_size,
+                              u64 node_offset, u8  node_depth,
+                              u8  inner_size , int is_last_node)
 {
-    // initial hash
+    // initial hash (parameter block)
     FOR (i, 0, 8) {
         ctx->hash[i] = iv[i];
     }
-    ctx->hash[0] ^= 0x01010000 ^ (key_size << 8) ^ hash_size;
+    ctx->hash[0] ^= hash_size ^ ((u64)fanout << 16) ^ ((u64)depth << 24)
+        ^ ((u64)leaf_size << 32);
+    ctx->hash[1] ^= node_offset;
+    ctx->hash[2] ^= node_depth ^ ((u64)inner_size << 8);
 
     ctx->input_offset[0] = 0;         // begining of the input, no offset
     ctx->input_offset[1] = 0;         // begining of the input, no offset
     ctx->hash_size       = hash_size; // remember the hash size we want
     ctx->input_idx       = 0;
+    ctx->last_node       = is_last_node ? (u64)-1 : 0;
+}
+
+void crypto_blake2b_general_init(crypto_blake2b_ctx *ctx, size_t hash_size,
+                                 const u8           *key, size_t key_size)
+{
+    // sequential mode: fanout and depth are 1
+    crypto_blake2b_tree_init(ctx, hash_size, 1, 1, 0, 0, 0, 0, 0);
+    ctx->hash[0] ^= key_size << 8;
 
     // if there is a key, the first block is that key (padded with zeroes)
     if (key_size > 0) {
@@ -587,35 +1308,57 @@ void crypto_blake2b_init(crypto_blake2b_ctx *ctx)
 void crypto_blake2b_update(crypto_blake2b_ctx *ctx,
                            const u8 *message, size_t message_size)
 {
-    // Align ourselves with block boundaries
-    size_t align = MIN(ALIGN(ctx->input_idx, 128), message_size);
-    blake2b_update(ctx, message, align);
-    message      += align;
-    message_size -= align;
+    // The last block is compressed differently, so we only compress a
+    // block once we know more input follows.  Until then, it stays in
+    // the buffer.
+    if (message_size == 0) {
+        return;
+    }
 
-    // Process the message block by block
-    FOR (i, 0, message_size >> 7) { // number of blocks
-        blake2b_end_block(ctx);
-        FOR (j, 0, 16) {
-            ctx->input[j] = load64_le(message + j*8);
+    // Fill the buffer, and compress it if there's more to come
+    if (ctx->input_idx > 0) {
+        size_t fill = MIN(128 - ctx->input_idx, message_size);
+        FOR (i, 0, fill) {
+            ctx->input[ctx->input_idx + i] = message[i];
         }
+        ctx->input_idx += fill;
+        message        += fill;
+        message_size   -= fill;
+        if (message_size == 0) {
+            return;
+        }
+        blake2b_compress_block(ctx, ctx->input);
+        ctx->input_idx = 0;
+    }
+
+    // Process the message block by block, straight from the message
+    // (keeping at least 1 byte for the last block)
+    size_t nb_blocks = (message_size - 1) >> 7;
+    FOR (i, 0, nb_blocks) {
+        blake2b_compress_block(ctx, message);
         message += 128;
-        ctx->input_idx = 128;
     }
-    message_size &= 127;
+    message_size -= nb_blocks << 7;
 
-    // remaining bytes
-    blake2b_update(ctx, message, message_size);
+    // remaining bytes (1 to 128)
+    FOR (i, 0, message_size) {
+        ctx->input[i] = message[i];
+    }
+    ctx->input_idx = message_size;
 }
 
-void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
+// Pads the last block, and updates the input offset
+static void blake2b_pad(crypto_blake2b_ctx *ctx)
 {
-    // Pad the end of the block with zeroes
     FOR (i, ctx->input_idx, 128) {
-        blake2b_set_input(ctx, 0, i);
+        ctx->input[i] = 0;
     }
-    blake2b_incr(ctx);         // update the input offset
-    blake2b_compress(ctx, -1); // compress the last block
+    blake2b_incr(ctx, ctx->input_idx);
+}
+
+// Outputs the hash once the last block is compressed
+static void blake2b_output(crypto_blake2b_ctx *ctx, u8 *hash)
+{
     size_t nb_words = ctx->hash_size >> 3;
     FOR (i, 0, nb_words) {
         store64_le(hash + i*8, ctx->hash[i]);
@@ -626,6 +1369,13 @@ void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
     WIPE_CTX(ctx);
 }
 
+void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
+{
+    blake2b_pad(ctx);                      // pad with zeroes
+    blake2b_compress(ctx, ctx->input, -1); // compress the last block
+    blake2b_output(ctx, hash);
+}
+
 void crypto_blake2b_general(u8       *hash   , size_t hash_size,
                             const u8 *key    , size_t key_size,
                             const u8 *message, size_t message_size)
@@ -641,6 +1391,171 @@ void crypto_blake2b(u8 hash[64], const u8 *message, size_t message_size)
     crypto_blake2b_general(hash, 64, 0, 0, message, message_size);
 }
 
+// Hashes nb_lanes messages at once (up to 8), one message per lane.
+// The blocks all messages have are compressed together.  The extra
+// blocks of the longer messages are compressed one by one.  The last
+// blocks are compressed together again.
+static void blake2b_lanes(u8 *hash[], size_t hash_size,
+                          const u8 *message[], const size_t message_size[],
+                          size_t nb_lanes)
+{
+    crypto_blake2b_ctx ctx[8];
+    const u8          *block[8];
+    size_t             nb_blocks = 0; // blocks in common, but the last
+    FOR (i, 0, nb_lanes) {
+        size_t size = message_size[i];
+        size_t n    = size == 0 ? 0 : (size - 1) >> 7;
+        nb_blocks   = i == 0 ? n : MIN(nb_blocks, n);
+        crypto_blake2b_general_init(ctx + i, hash_size, 0, 0);
+    }
+    FOR (b, 0, nb_blocks) {
+        FOR (i, 0, nb_lanes) {
+            blake2b_incr(ctx + i, 128);
+            block[i] = message[i] + b * 128;
+        }
+        blake2b_compress_lanes(ctx, block, nb_lanes, 0);
+    }
+    FOR (i, 0, nb_lanes) {
+        crypto_blake2b_update(ctx + i, message[i]      + nb_blocks * 128,
+                                       message_size[i] - nb_blocks * 128);
+        blake2b_pad(ctx + i);
+        block[i] = ctx[i].input;
+    }
+    blake2b_compress_lanes(ctx, block, nb_lanes, -1);
+    FOR (i, 0, nb_lanes) {
+        blake2b_output(ctx + i, hash[i]);
+    }
+}
+
+void crypto_blake2b_x4(u8 *hash[4], size_t hash_size,
+                       const u8 *message[4], const size_t message_size[4])
+{
+    blake2b_lanes(hash, hash_size, message, message_size, 4);
+}
+
+void crypto_blake2b_x8(u8 *hash[8], size_t hash_size,
+                       const u8 *message[8], const size_t message_size[8])
+{
+    blake2b_lanes(hash, hash_size, message, message_size, 8);
+}
+
+// Blake2bp: the message is cut in 128-byte blocks, dealt to 4 leaves
+// in turn.  Every 512-byte stripe gives one block to each leaf, so the
+// leaves are compressed together, one per lane.
+void crypto_blake2bp_init(crypto_blake2bp_ctx *ctx)
+{
+    FOR (i, 0, 4) {
+        crypto_blake2b_tree_init(ctx->leaves + i, 64, 4, 2, 0, i, 0, 64,
+                                 i == 3);
+    }
+    ctx->input_idx = 0;
+}
+
+// Feeds the message to the leaves, one block at a time
+static void blake2bp_deal(crypto_blake2bp_ctx *ctx,
+                          const u8 *message, size_t message_size)
+{
+    while (message_size > 0) {
+        size_t size = MIN(128 - (ctx->input_idx & 127), message_size);
+        crypto_blake2b_update(ctx->leaves + (ctx->input_idx >> 7),
+                              message, size);
+        ctx->input_idx = (ctx->input_idx + size) & 511;
+        message       += size;
+        message_size  -= size;
+    }
+}
+
+void crypto_blake2bp_update(crypto_blake2bp_ctx *ctx,
+                            const u8 *message, size_t message_size)
+{
+    // Align ourselves with stripe boundaries
+    size_t align = MIN(ALIGN(ctx->input_idx, 512), message_size);
+    blake2bp_deal(ctx, message, align);
+    message      += align;
+    message_size -= align;
+
+    // A leaf only compresses a block once it knows more input follows.
+    // With more than 384 bytes to come, they all do.
+    if (message_size > 384) {
+        const u8 *block[4];
+        if (ctx->leaves[0].input_idx == 128) { // pending blocks
+            FOR (i, 0, 4) {
+                blake2b_incr(ctx->leaves + i, 128);
+                block[i] = ctx->leaves[i].input;
+                ctx->leaves[i].input_idx = 0;
+            }
+            blake2b_compress_lanes(ctx->leaves, block, 4, 0);
+        }
+        // Whole stripes, straight from the message
+        size_t nb_stripes = (message_size - 385) >> 9;
+        FOR (s, 0, nb_stripes) {
+            FOR (i, 0, 4) {
+                blake2b_incr(ctx->leaves + i, 128);
+                block[i] = message + i * 128;
+            }
+            blake2b_compress_lanes(ctx->leaves, block, 4, 0);
+            message += 512;
+        }
+        message_size -= nb_stripes << 9;
+    }
+
+    // remaining bytes
+    blake2bp_deal(ctx, message, message_size);
+}
+
+// Feeds a leaf its own blocks, skipping those of the other leaves.
+// Only reads ctx->input_idx, so the 4 leaves can be fed concurrently.
+void crypto_blake2bp_update_leaf(crypto_blake2bp_ctx *ctx, unsigned leaf,
+                                 const u8 *message, size_t message_size)
+{
+    size_t offset = 0;
+    while (offset < message_size) {
+        size_t idx  = (ctx->input_idx + offset) & 511;
+        size_t size = MIN(128 - (idx & 127), message_size - offset);
+        if (idx >> 7 == leaf) {
+            crypto_blake2b_update(ctx->leaves + leaf, message + offset, size);
+        }
+        offset += size;
+    }
+}
+
+void crypto_blake2bp_update_done(crypto_blake2bp_ctx *ctx,
+                                 size_t message_size)
+{
+    ctx->input_idx = (ctx->input_idx + message_size) & 511;
+}
+
+void crypto_blake2bp_final(crypto_blake2bp_ctx *ctx, u8 hash[64])
+{
+    // last block of each leaf
+    const u8 *block[4];
+    FOR (i, 0, 4) {
+        blake2b_pad(ctx->leaves + i);
+        block[i] = ctx->leaves[i].input;
+    }
+    blake2b_compress_lanes(ctx->leaves, block, 4, -1);
+
+    // root node
+    crypto_blake2b_ctx root;
+    u8                 leaf_hash[64];
+    crypto_blake2b_tree_init(&root, 64, 4, 2, 0, 0, 1, 64, 1);
+    FOR (i, 0, 4) {
+        blake2b_output(ctx->leaves + i, leaf_hash);
+        crypto_blake2b_update(&root, leaf_hash, 64);
+    }
+    crypto_blake2b_final(&root, hash);
+    WIPE_BUFFER(leaf_hash);
+    WIPE_CTX(ctx);
+}
+
+void crypto_blake2bp(u8 hash[64], const u8 *message, size_t message_size)
+{
+    crypto_blake2bp_ctx ctx;
+    crypto_blake2bp_init  (&ctx);
+    crypto_blake2bp_update(&ctx, message, message_size);
+    crypto_blake2bp_final (&ctx, hash);
+}
+
 
 ////////////////
 /// Argon2 i ///
@@ -684,6 +1599,18 @@ static void store_block(u8 bytes[1024], const block *b)
 static void copy_block(block *o,const block*in){FOR(i,0,128)o->a[i] = in->a[i];}
 static void  xor_block(block *o,const block*in){FOR(i,0,128)o->a[i]^= in->a[i];}
 
+// Hints the processor to start loading a block in cache (64 byte lines)
+static void prefetch_block(const block *b)
+{
+#ifdef __GNUC__
+    FOR (i, 0, 16) {
+        __builtin_prefetch(b->a + i*8);
+    }
+#else
+    (void)b;
+#endif
+}
+
 // Hash with a virtually unlimited digest size.
 // Doesn't extract more entropy than the base hash function.
 // Mainly used for filling a whole kilobyte block with pseudo-random bytes.
@@ -718,6 +1645,219 @@ static void extended_hash(u8       *digest, u32 digest_size,
     }
 }
 
+#ifdef __AVX512F__
+#include <immintrin.h>
+
+// Each vector holds the rows of two rounds (one per 256-bit half), so
+// each G operates on 8 columns at once.
+#define ADD(x, y) _mm512_add_epi64(x, y)
+#define XOR(x, y) _mm512_xor_si512(x, y)
+#define LOAD(p)     _mm256_loadu_si256((const __m256i*)(p))
+#define STORE(p, x) _mm256_storeu_si256((__m256i*)(p), x)
+#define LO(x)       _mm512_castsi512_si256(x)
+#define HI(x)       _mm512_extracti64x4_epi64(x, 1)
+#define JOIN(x, y)  _mm512_inserti64x4(_mm512_castsi256_si512(x), y, 1)
+#define SWAP(x)     _mm512_shuffle_i64x2(x, x, _MM_SHUFFLE(3, 1, 2, 0))
+
+// x + y + 2 * LSB(x) * LSB(y)
+static __m512i blamka(__m512i x, __m512i y)
+{
+    __m512i xy = _mm512_mul_epu32(x, y);
+    return ADD(ADD(x, y), ADD(xy, xy));
+}
+
+#define G8(a, b, c, d)                                          \
+    a = blamka(a, b);  d = _mm512_ror_epi64(XOR(d, a), 32);     \
+    c = blamka(c, d);  b = _mm512_ror_epi64(XOR(b, c), 24);     \
+    a = blamka(a, b);  d = _mm512_ror_epi64(XOR(d, a), 16);     \
+    c = blamka(c, d);  b = _mm512_ror_epi64(XOR(b, c), 63)
+#define ROUND8(a, b, c, d)                                      \
+    G8(a, b, c, d);                                             \
+    b = _mm512_permutex_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));      \
+    c = _mm512_permutex_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));      \
+    d = _mm512_permutex_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));      \
+    G8(a, b, c, d);                                             \
+    b = _mm512_permutex_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));      \
+    c = _mm512_permutex_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));      \
+    d = _mm512_permutex_epi64(d, _MM_SHUFFLE(0, 3, 2, 1))
+
+// Loads (or stores) words {i..i+3, i+16..i+19} of a block
+static __m512i load_x2(const u64 *w) { return JOIN(LOAD(w), LOAD(w + 16)); }
+static void store_x2(u64 *w, __m512i x)
+{
+    STORE(w     , LO(x));
+    STORE(w + 16, HI(x));
+}
+
+// Core of the compression function G.  Computes R = X ^ Y, and Z from R
+// (Q goes to tmp). Then result = R ^ Z, or result ^= R ^ Z.
+// X, Y and the result are each walked once; the result may alias X.
+static void g_rounds(block *result, const block *x, const block *y,
+                     block *tmp, int xor_result)
+{
+    u64 *w = tmp->a;
+    u64 *o = result->a;
+    // column rounds (tmp = Q), i and i + 16 side by side
+    for (int i = 0; i < 128; i += 32) {
+        __m512i v[4];
+        FOR (j, 0, 4) {
+            size_t k = i + j*4;
+            v[j] = XOR(load_x2(x->a + k), load_x2(y->a + k));
+        }
+        FOR (j, 0, 4) {
+            size_t k = i + j*4;
+            store_x2(o + k, xor_result ? XOR(v[j], load_x2(o + k)) : v[j]);
+        }
+        ROUND8(v[0], v[1], v[2], v[3]);
+        FOR (j, 0, 4) {
+            store_x2(w + i + j*4, v[j]);
+        }
+    }
+    // row rounds (Z), i and i + 2 side by side, straight into the result.
+    // Words {i..i+3, i+16..i+19} are swapped in the middle, so that
+    // each half gets {i, i+1, i+16, i+17} and {i+2, i+3, i+18, i+19}.
+    for (int i = 0; i < 16; i += 4) {
+        __m512i v[4];
+        FOR (j, 0, 4) {
+            v[j] = SWAP(load_x2(w + i + j*32));
+        }
+        ROUND8(v[0], v[1], v[2], v[3]);
+        FOR (j, 0, 4) {
+            u64 *p = o + i + j*32;
+            store_x2(p, XOR(SWAP(v[j]), load_x2(p)));
+        }
+    }
+}
+#undef ADD
+#undef XOR
+#undef LOAD
+#undef STORE
+#undef LO
+#undef HI
+#undef JOIN
+#undef SWAP
+#undef G8
+#undef ROUND8
+
+#elif defined(__AVX2__)
+
+// The rows of a round are held in 4 vectors a, b, c, d, so each G
+// operates on 4 columns at once.
+#define ADD(x, y) _mm256_add_epi64(x, y)
+#define XOR(x, y) _mm256_xor_si256(x, y)
+#ifdef __AVX512VL__
+#define ROTR32(x) _mm256_ror_epi64(x, 32)
+#define ROTR24(x) _mm256_ror_epi64(x, 24)
+#define ROTR16(x) _mm256_ror_epi64(x, 16)
+#define ROTR63(x) _mm256_ror_epi64(x, 63)
+#else
+#define ROTR32(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24(x) _mm256_shuffle_epi8(x, r24)
+#define ROTR16(x) _mm256_shuffle_epi8(x, r16)
+#define ROTR63(x) XOR(_mm256_srli_epi64(x, 63), ADD(x, x))
+#endif
+#define LOAD(p)        _mm256_loadu_si256((const __m256i*)(p))
+#define STORE(p, x)    _mm256_storeu_si256((__m256i*)(p), x)
+
+// x + y + 2 * LSB(x) * LSB(y)
+static __m256i blamka(__m256i x, __m256i y)
+{
+    __m256i xy = _mm256_mul_epu32(x, y);
+    return ADD(ADD(x, y), ADD(xy, xy));
+}
+
+// Loads (or stores) words {i, i+1, i+16, i+17} of a block
+static __m256i load_pair(const u64 *w)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i*)(w     ));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(w + 16));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+static void xor_pair(u64 *w, __m256i x)
+{
+    __m128i *lo = (__m128i*)(w     );
+    __m128i *hi = (__m128i*)(w + 16);
+    _mm_storeu_si128(lo, _mm_xor_si128(_mm_loadu_si128(lo),
+                                       _mm256_castsi256_si128(x)));
+    _mm_storeu_si128(hi, _mm_xor_si128(_mm_loadu_si128(hi),
+                                       _mm256_extracti128_si256(x, 1)));
+}
+#define G4(a, b, c, d)                                  \
+    a = blamka(a, b);  d = ROTR32(XOR(d, a));           \
+    c = blamka(c, d);  b = ROTR24(XOR(b, c));           \
+    a = blamka(a, b);  d = ROTR16(XOR(d, a));           \
+    c = blamka(c, d);  b = ROTR63(XOR(b, c))
+#define ROUND4(a, b, c, d)                                      \
+    G4(a, b, c, d);                                             \
+    b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1));   \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));   \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3));   \
+    G4(a, b, c, d);                                             \
+    b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3));   \
+    c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2));   \
+    d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1))
+
+// Core of the compression function G.  Computes R = X ^ Y, and Z from R
+// (Q goes to tmp). Then result = R ^ Z, or result ^= R ^ Z.
+// X, Y and the result are each walked once; the result may alias X.
+static void g_rounds(block *result, const block *x, const block *y,
+                     block *tmp, int xor_result)
+{
+#ifndef __AVX512VL__
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2,
+                                         11, 12, 13, 14, 15, 8, 9, 10);
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1,
+                                         10, 11, 12, 13, 14, 15, 8, 9);
+#endif
+    u64 *w = tmp->a;
+    u64 *o = result->a;
+    // column rounds (tmp = Q)
+    for (int i = 0; i < 128; i += 16) {
+        __m256i v[4];
+        FOR (j, 0, 4) {
+            size_t k = i + j*4;
+            v[j] = XOR(LOAD(x->a + k), LOAD(y->a + k));
+        }
+        FOR (j, 0, 4) {
+            size_t k = i + j*4;
+            STORE(o + k, xor_result ? XOR(v[j], LOAD(o + k)) : v[j]);
+        }
+        ROUND4(v[0], v[1], v[2], v[3]);
+        FOR (j, 0, 4) {
+            STORE(w + i + j*4, v[j]);
+        }
+    }
+    // row rounds (Z), straight into the result
+    for (int i = 0; i < 16; i += 2) {
+        __m256i a = load_pair(w + i     );
+        __m256i b = load_pair(w + i + 32);
+        __m256i c = load_pair(w + i + 64);
+        __m256i d = load_pair(w + i + 96);
+        ROUND4(a, b, c, d);
+        xor_pair(o + i     , a);
+        xor_pair(o + i + 32, b);
+        xor_pair(o + i + 64, c);
+        xor_pair(o + i + 96, d);
+    }
+}
+
+#undef ADD
+#undef XOR
+#undef ROTR32
+#undef ROTR24
+#undef ROTR16
+#undef ROTR63
+#undef LOAD
+#undef STORE
+#undef G4
+#undef ROUND4
+
+#else
+
 #define LSB(x) ((x) & 0xffffffff)
 #define G(a, b, c, d)                                            \
     a += b + 2 * LSB(a) * LSB(b);  d ^= a;  d = rotr64(d, 32);   \
@@ -731,51 +1871,47 @@ static void extended_hash(u8       *digest, u32 digest_size,
     G(v0, v5, v10, v15);  G(v1, v6, v11, v12);          \
     G(v2, v7,  v8, v13);  G(v3, v4,  v9, v14)
 
-// Core of the compression function G.  Computes Z from R in place.
-static void g_rounds(block *work_block)
-{
-    // column rounds (work_block = Q)
-    for (int i = 0; i < 128; i += 16) {
-        ROUND(work_block->a[i     ], work_block->a[i +  1],
-              work_block->a[i +  2], work_block->a[i +  3],
-              work_block->a[i +  4], work_block->a[i +  5],
-              work_block->a[i +  6], work_block->a[i +  7],
-              work_block->a[i +  8], work_block->a[i +  9],
-              work_block->a[i + 10], work_block->a[i + 11],
-              work_block->a[i + 12], work_block->a[i + 13],
-              work_block->a[i + 14], work_block->a[i + 15]);
-    }
-    // row rounds (work_block = Z)
+// Core of the compression function G.  Computes R = X ^ Y, and Z from R
+// (in tmp). Then result = R ^ Z, or result ^= R ^ Z.
+// The result may alias X.
+static void g_rounds(block *result, const block *x, const block *y,
+                     block *tmp, int xor_result)
+{
+    // column rounds (tmp = Q)
+    for (size_t i = 0; i < 128; i += 16) {
+        FOR (j, i, i + 16) {
+            u64 r        = x->a[j] ^ y->a[j];
+            tmp   ->a[j] = r;
+            result->a[j] = xor_result ? result->a[j] ^ r : r;
+        }
+        ROUND(tmp->a[i     ], tmp->a[i +  1], tmp->a[i +  2], tmp->a[i +  3],
+              tmp->a[i +  4], tmp->a[i +  5], tmp->a[i +  6], tmp->a[i +  7],
+              tmp->a[i +  8], tmp->a[i +  9], tmp->a[i + 10], tmp->a[i + 11],
+              tmp->a[i + 12], tmp->a[i + 13], tmp->a[i + 14], tmp->a[i + 15]);
+    }
+    // row rounds (tmp = Z)
     for (int i = 0; i < 16; i += 2) {
-        ROUND(work_block->a[i      ], work_block->a[i +   1],
-              work_block->a[i +  16], work_block->a[i +  17],
-              work_block->a[i +  32], work_block->a[i +  33],
-              work_block->a[i +  48], work_block->a[i +  49],
-              work_block->a[i +  64], work_block->a[i +  65],
-              work_block->a[i +  80], work_block->a[i +  81],
-              work_block->a[i +  96], work_block->a[i +  97],
-              work_block->a[i + 112], work_block->a[i + 113]);
+        ROUND(tmp->a[i      ], tmp->a[i +   1], tmp->a[i +  16],
+              tmp->a[i +  17], tmp->a[i +  32], tmp->a[i +  33],
+              tmp->a[i +  48], tmp->a[i +  49], tmp->a[i +  64],
+              tmp->a[i +  65], tmp->a[i +  80], tmp->a[i +  81],
+              tmp->a[i +  96], tmp->a[i +  97], tmp->a[i + 112],
+              tmp->a[i + 113]);
     }
+    xor_block(result, tmp);
 }
+#endif
 
 // The compression function G (copy version for the first pass)
 static void g_copy(block *result, const block *x, const block *y, block* tmp)
 {
-    copy_block(tmp   , x  ); // tmp    = X
-    xor_block (tmp   , y  ); // tmp    = X ^ Y = R
-    copy_block(result, tmp); // result = R         (only difference with g_xor)
-    g_rounds  (tmp);         // tmp    = Z
-    xor_block (result, tmp); // result = R ^ Z
+    g_rounds(result, x, y, tmp, 0); // result = R ^ Z
 }
 
 // The compression function G (xor version for subsequent passes)
 static void g_xor(block *result, const block *x, const block *y, block *tmp)
 {
-    copy_block(tmp   , x  ); // tmp    = X
-    xor_block (tmp   , y  ); // tmp    = X ^ Y = R
-    xor_block (result, tmp); // result = R ^ old   (only difference with g_copy)
-    g_rounds  (tmp);         // tmp    = Z
-    xor_block (result, tmp); // result = R ^ old ^ Z
+    g_rounds(result, x, y, tmp, 1); // result = R ^ Z ^ old
 }
 
 // unary version of the compression function.
@@ -783,11 +1919,9 @@ static void g_xor(block *result, const block *x, const block *y, block *tmp)
 // Does the transformation in place.
 static void unary_g(block *work_block)
 {
-    // work_block == R
+    static const block zero_block = {{0}};
     block tmp;
-    copy_block(&tmp, work_block); // tmp        = R
-    g_rounds(work_block);         // work_block = Z
-    xor_block(work_block, &tmp);  // work_block = Z ^ R
+    g_copy(work_block, work_block, &zero_block, &tmp); // R ^ Z
     wipe_block(&tmp);
 }
 
@@ -799,8 +1933,11 @@ typedef struct {
     block b;
     u32 pass_number;
     u32 slice_number;
+    u32 lane;
     u32 nb_blocks;
     u32 nb_iterations;
+    u32 nb_lanes;
+    u32 algorithm;
     u32 ctr;
     u32 offset;
 } gidx_ctx;
@@ -813,11 +1950,11 @@ static void gidx_refresh(gidx_ctx *ctx)
 {
     // seed the begining of the block...
     ctx->b.a[0] = ctx->pass_number;
-    ctx->b.a[1] = 0;  // lane number (we have only one)
+    ctx->b.a[1] = ctx->lane;
     ctx->b.a[2] = ctx->slice_number;
     ctx->b.a[3] = ctx->nb_blocks;
     ctx->b.a[4] = ctx->nb_iterations;
-    ctx->b.a[5] = 1;  // type: Argon2i
+    ctx->b.a[5] = ctx->algorithm;  // type: Argon2i or Argon2id
     ctx->b.a[6] = ctx->ctr;
     FOR (i, 7, 128) { ctx->b.a[i] = 0; } // ...then zero the rest out
 
@@ -827,14 +1964,28 @@ static void gidx_refresh(gidx_ctx *ctx)
     unary_g(&ctx->b);
 }
 
+// Argon2i, and Argon2id during the first half of the first pass, use
+// the above.  Otherwise (Argon2d), the pseudo-random numbers come from
+// the previous block: stronger against offline attacks, weaker against
+// timing attacks.
+static int is_data_independent(u32 algorithm, u32 pass_number, u32 slice)
+{
+    return algorithm == CRYPTO_ARGON2_I
+        || (algorithm == CRYPTO_ARGON2_ID && pass_number == 0 && slice < 2);
+}
+
 static void gidx_init(gidx_ctx *ctx,
-                      u32 pass_number, u32 slice_number,
-                      u32 nb_blocks,   u32 nb_iterations)
+                      u32 pass_number, u32 slice_number, u32 lane,
+                      u32 nb_blocks,   u32 nb_iterations, u32 nb_lanes,
+                      u32 algorithm)
 {
     ctx->pass_number   = pass_number;
     ctx->slice_number  = slice_number;
+    ctx->lane          = lane;
     ctx->nb_blocks     = nb_blocks;
     ctx->nb_iterations = nb_iterations;
+    ctx->nb_lanes      = nb_lanes;
+    ctx->algorithm     = algorithm;
     ctx->ctr           = 0;
 
     // Offset from the begining of the segment.  For the first slice
@@ -844,21 +1995,27 @@ static void gidx_init(gidx_ctx *ctx,
         ctx->offset = 0;
     } else {
         ctx->offset = 2;
-        ctx->ctr++;         // Compensates for missed lazy creation
-        gidx_refresh(ctx);  // at the start of gidx_next()
+        if (is_data_independent(algorithm, pass_number, slice_number)) {
+            ctx->ctr++;         // Compensates for missed lazy creation
+            gidx_refresh(ctx);  // at the start of gidx_next()
+        }
     }
 }
 
-static u32 gidx_next(gidx_ctx *ctx)
+// Reference block from a pseudo-random word (J1 and J2)
+static u32 gidx_reference(gidx_ctx *ctx, u64 seed)
 {
-    // lazily creates the offset block we need
-    if ((ctx->offset & 127) == 0) {
-        ctx->ctr++;
-        gidx_refresh(ctx);
-    }
-    u32 index  = ctx->offset & 127; // save index  for current call
-    u32 offset = ctx->offset;       // save offset for current call
-    ctx->offset++;                  // update offset for next call
+    u32 offset = ctx->offset; // save offset for current call
+    ctx->offset++;            // update offset for next call
+
+    // Reference lane.  The first slice of the first pass stays in the
+    // current lane: the others aren't filled yet.
+    int first_pass = ctx->pass_number == 0;
+    u64 j1         = seed & 0xffffffff; // pseudo-random number
+    u64 j2         = seed >> 32;        // pseudo-random number
+    u32 lane       = first_pass && ctx->slice_number == 0
+                   ? ctx->lane
+                   : (u32)(j2 % ctx->nb_lanes);
 
     // Computes the area size.
     // Pass 0 : all already finished segments plus already constructed
@@ -866,10 +2023,14 @@ static u32 gidx_next(gidx_ctx *ctx)
     // Pass 1+: 3 last segments plus already constructed
     //          blocks in this segment.  THE SPEC SUGGESTS OTHERWISE.
     //          I CONFORM TO THE REFERENCE IMPLEMENTATION.
-    int first_pass  = ctx->pass_number == 0;
-    u32 slice_size  = ctx->nb_blocks >> 2;
+    // Other lanes only contribute finished segments, minus their last
+    // block if this one is the first of its segment.
+    u32 lane_size   = ctx->nb_blocks / ctx->nb_lanes;
+    u32 slice_size  = lane_size >> 2;
     u32 nb_segments = first_pass ? ctx->slice_number : 3;
-    u32 area_size   = nb_segments * slice_size + offset - 1;
+    u32 area_size   = nb_segments * slice_size;
+    if      (lane == ctx->lane) { area_size += offset - 1; }
+    else if (offset == 0      ) { area_size -= 1;          }
 
     // Computes the starting position of the reference area.
     // CONTRARY TO WHAT THE SPEC SUGGESTS, IT STARTS AT THE
@@ -877,112 +2038,251 @@ static u32 gidx_next(gidx_ctx *ctx)
     u32 next_slice = ((ctx->slice_number + 1) & 3) * slice_size;
     u32 start_pos  = first_pass ? 0 : next_slice;
 
-    // Generate offset from J1 (no need for J2, there's only one lane)
-    u64 j1         = ctx->b.a[index] & 0xffffffff; // pseudo-random number
+    // Generate offset from J1
     u64 x          = (j1 * j1)       >> 32;
     u64 y          = (area_size * x) >> 32;
     u64 z          = (area_size - 1) - y;
-    return (start_pos + z) % ctx->nb_blocks;
+    return lane * lane_size + (start_pos + z) % lane_size;
 }
 
-// Main algorithm
-void crypto_argon2i_general(u8       *hash,      u32 hash_size,
-                            void     *work_area, u32 nb_blocks,
-                            u32 nb_iterations,
-                            const u8 *password,  u32 password_size,
-                            const u8 *salt,      u32 salt_size,
-                            const u8 *key,       u32 key_size,
-                            const u8 *ad,        u32 ad_size)
+// Reference block, from public information only
+static u32 gidx_next(gidx_ctx *ctx)
 {
-    // work area seen as blocks (must be suitably aligned)
-    block *blocks = (block*)work_area;
-    {
-        crypto_blake2b_ctx ctx;
-        crypto_blake2b_init(&ctx);
-
-        blake_update_32      (&ctx, 1            ); // p: number of threads
-        blake_update_32      (&ctx, hash_size    );
-        blake_update_32      (&ctx, nb_blocks    );
-        blake_update_32      (&ctx, nb_iterations);
-        blake_update_32      (&ctx, 0x13         ); // v: version number
-        blake_update_32      (&ctx, 1            ); // y: Argon2i
-        blake_update_32      (&ctx,           password_size);
-        crypto_blake2b_update(&ctx, password, password_size);
-        blake_update_32      (&ctx,           salt_size);
-        crypto_blake2b_update(&ctx, salt,     salt_size);
-        blake_update_32      (&ctx,           key_size);
-        crypto_blake2b_update(&ctx, key,      key_size);
-        blake_update_32      (&ctx,           ad_size);
-        crypto_blake2b_update(&ctx, ad,       ad_size);
-
-        u8 initial_hash[72]; // 64 bytes plus 2 words for future hashes
-        crypto_blake2b_final(&ctx, initial_hash);
-
-        // fill first 2 blocks
-        block tmp_block;
-        u8    hash_area[1024];
-        store32_le(initial_hash + 64, 0); // first  additional word
-        store32_le(initial_hash + 68, 0); // second additional word
-        extended_hash(hash_area, 1024, initial_hash, 72);
-        load_block(&tmp_block, hash_area);
-        copy_block(blocks, &tmp_block);
-
-        store32_le(initial_hash + 64, 1); // slight modification
-        extended_hash(hash_area, 1024, initial_hash, 72);
-        load_block(&tmp_block, hash_area);
-        copy_block(blocks + 1, &tmp_block);
-
-        WIPE_BUFFER(initial_hash);
-        WIPE_BUFFER(hash_area);
-        wipe_block(&tmp_block);
+    // lazily creates the offset block we need
+    if ((ctx->offset & 127) == 0) {
+        ctx->ctr++;
+        gidx_refresh(ctx);
     }
+    return gidx_reference(ctx, ctx->b.a[ctx->offset & 127]);
+}
+
+// Main algorithm
+void crypto_argon2_start(crypto_argon2_ctx *ctx, u32 algorithm,
+                         u32 hash_size,
+                         void     *work_area, u32 nb_blocks,
+                         u32 nb_iterations  , u32 nb_lanes,
+                         const u8 *password,  u32 password_size,
+                         const u8 *salt,      u32 salt_size,
+                         const u8 *key,       u32 key_size,
+                         const u8 *ad,        u32 ad_size)
+{
+    crypto_blake2b_ctx hash_ctx;
+    crypto_blake2b_init(&hash_ctx);
+
+    blake_update_32      (&hash_ctx, nb_lanes     ); // p: number of threads
+    blake_update_32      (&hash_ctx, hash_size    );
+    blake_update_32      (&hash_ctx, nb_blocks    );
+    blake_update_32      (&hash_ctx, nb_iterations);
+    blake_update_32      (&hash_ctx, 0x13         ); // v: version number
+    blake_update_32      (&hash_ctx, algorithm    ); // y: d, i, or id
+    blake_update_32      (&hash_ctx,           password_size);
+    crypto_blake2b_update(&hash_ctx, password, password_size);
+    blake_update_32      (&hash_ctx,           salt_size);
+    crypto_blake2b_update(&hash_ctx, salt,     salt_size);
+    blake_update_32      (&hash_ctx,           key_size);
+    crypto_blake2b_update(&hash_ctx, key,      key_size);
+    blake_update_32      (&hash_ctx,           ad_size);
+    crypto_blake2b_update(&hash_ctx, ad,       ad_size);
+
+    u8 initial_hash[72]; // 64 bytes plus 2 words for future hashes
+    crypto_blake2b_final(&hash_ctx, initial_hash);
 
     // Actual number of blocks
-    nb_blocks -= nb_blocks & 3; // round down to 4 p (p == 1 thread)
-    const u32 segment_size = nb_blocks >> 2;
+    nb_blocks -= nb_blocks % (4 * nb_lanes); // round down to 4 p
+    ctx->work_area     = work_area;
+    ctx->hash_size     = hash_size;
+    ctx->nb_blocks     = nb_blocks;
+    ctx->nb_iterations = nb_iterations;
+    ctx->nb_lanes      = nb_lanes;
+    ctx->algorithm     = algorithm;
+    ctx->indices       = 0;
+
+    // work area seen as blocks (must be suitably aligned)
+    block *blocks    = (block*)work_area;
+    u32    lane_size = nb_blocks / nb_lanes;
+
+    // fill first 2 blocks of each lane
+    block tmp_block;
+    u8    hash_area[1024];
+    FOR (lane, 0, nb_lanes) {
+        FOR (i, 0, 2) {
+            store32_le(initial_hash + 64, (u32)i   ); // block number
+            store32_le(initial_hash + 68, (u32)lane);
+            extended_hash(hash_area, 1024, initial_hash, 72);
+            load_block(&tmp_block, hash_area);
+            copy_block(blocks + lane * lane_size + i, &tmp_block);
+        }
+    }
+
+    WIPE_BUFFER(initial_hash);
+    WIPE_BUFFER(hash_area);
+    wipe_block(&tmp_block);
+}
+
+void crypto_argon2i_start(crypto_argon2_ctx *ctx, u32 hash_size,
+                          void     *work_area, u32 nb_blocks,
+                          u32 nb_iterations  , u32 nb_lanes,
+                          const u8 *password,  u32 password_size,
+                          const u8 *salt,      u32 salt_size,
+                          const u8 *key,       u32 key_size,
+                          const u8 *ad,        u32 ad_size)
+{
+    crypto_argon2_start(ctx, CRYPTO_ARGON2_I, hash_size,
+                        work_area, nb_blocks, nb_iterations, nb_lanes,
+                        password, password_size, salt, salt_size,
+                        key, key_size, ad, ad_size);
+}
+
+void crypto_argon2_fill_segment(const crypto_argon2_ctx *ctx,
+                                u32 pass_number, u32 slice, u32 lane)
+{
+    block *blocks       = (block*)ctx->work_area;
+    u32    lane_size    = ctx->nb_blocks / ctx->nb_lanes;
+    u32    segment_size = lane_size >> 2;
+    u32    lane_start   = lane * lane_size;
+    int    first_pass   = pass_number == 0;
+    int    independent  = is_data_independent(ctx->algorithm,
+                                               pass_number, slice);
+
+    // The index table only holds Argon2i references
+    const u32 *indices = ctx->indices == 0
+                      || ctx->algorithm != CRYPTO_ARGON2_I
+                       ? 0
+                       : ctx->indices + (size_t)pass_number * ctx->nb_blocks;
 
-    // fill (then re-fill) the rest of the blocks
     block tmp;
-    gidx_ctx ctx;
+    gidx_ctx gidx;
+    if (indices == 0) {
+        gidx_init(&gidx, pass_number, slice, lane,
+                  ctx->nb_blocks, ctx->nb_iterations, ctx->nb_lanes,
+                  ctx->algorithm);
+    }
+
+    // On the first segment of the first pass,
+    // blocks 0 and 1 are already filled.
+    // We use the offset to skip them.
+    u32 start_offset  = first_pass && slice == 0 ? 2 : 0;
+    u32 segment_start = lane_start + slice * segment_size + start_offset;
+    u32 segment_end   = lane_start + (slice + 1) * segment_size;
+    // The reference blocks are read at random.  Data independent ones
+    // are known one step ahead: the next one is fetched while the
+    // current one is being computed.
+    u32 reference_block = indices     ? indices[segment_start]
+                        : independent ? gidx_next(&gidx)
+                        : 0;
+    FOR (current_block, segment_start, segment_end) {
+        u32 previous_block  = current_block == lane_start
+                            ? lane_start + lane_size - 1
+                            : (u32)current_block - 1;
+        block *p = blocks + previous_block;
+        u32 next_reference  = reference_block;
+        if (!independent) {
+            // the first word of the previous block gives J1 and J2
+            reference_block = gidx_reference(&gidx, p->a[0]);
+        } else if (current_block + 1 < segment_end) {
+            next_reference = indices
+                           ? indices[current_block + 1]
+                           : gidx_next(&gidx);
+            prefetch_block(blocks + next_reference);
+        }
+        block *c = blocks + current_block;
+        block *r = blocks + reference_block;
+        if (first_pass) { g_copy(c, p, r, &tmp); }
+        else            { g_xor (c, p, r, &tmp); }
+        reference_block = next_reference;
+    }
+    wipe_block(&gidx.b);
+    wipe_block(&tmp);
+}
+
+void crypto_argon2i_indices(u32 *indices, u32 nb_blocks,
+                            u32 nb_iterations, u32 nb_lanes)
+{
+    nb_blocks -= nb_blocks % (4 * nb_lanes); // same rounding as start()
+    u32 lane_size    = nb_blocks / nb_lanes;
+    u32 segment_size = lane_size >> 2;
+    gidx_ctx gidx;
     FOR (pass_number, 0, nb_iterations) {
-        int first_pass = pass_number == 0;
-
-        FOR (segment, 0, 4) {
-            gidx_init(&ctx, (u32)pass_number, (u32)segment,
-                      nb_blocks, nb_iterations);
-
-            // On the first segment of the first pass,
-            // blocks 0 and 1 are already filled.
-            // We use the offset to skip them.
-            u32 start_offset  = first_pass && segment == 0 ? 2 : 0;
-            u32 segment_start = (u32)segment * segment_size + start_offset;
-            u32 segment_end   = ((u32)segment + 1) * segment_size;
-            FOR (current_block, segment_start, segment_end) {
-                u32 reference_block = gidx_next(&ctx);
-                u32 previous_block  = current_block == 0
-                                    ? nb_blocks - 1
-                                    : (u32)current_block - 1;
-                block *c = blocks + current_block;
-                block *p = blocks + previous_block;
-                block *r = blocks + reference_block;
-                if (first_pass) { g_copy(c, p, r, &tmp); }
-                else            { g_xor (c, p, r, &tmp); }
+        u32 *pass = indices + pass_number * nb_blocks;
+        FOR (slice, 0, 4) {
+            FOR (lane, 0, nb_lanes) {
+                // blocks 0 and 1 of the first pass have no reference
+                u32  start   = pass_number == 0 && slice == 0 ? 2 : 0;
+                u32 *segment = pass + lane * lane_size + slice * segment_size;
+                FOR (i, 0, start) {
+                    segment[i] = 0;
+                }
+                gidx_init(&gidx, (u32)pass_number, (u32)slice, (u32)lane,
+                          nb_blocks, nb_iterations, nb_lanes,
+                          CRYPTO_ARGON2_I);
+                FOR (i, start, segment_size) {
+                    segment[i] = gidx_next(&gidx);
+                }
             }
         }
     }
-    wipe_block(&ctx.b);
-    wipe_block(&tmp);
-    // hash the very last block with H' into the output hash
+    wipe_block(&gidx.b);
+}
+
+void crypto_argon2_finish(crypto_argon2_ctx *ctx, u8 *hash)
+{
+    // hash the xor of the last blocks of each lane, with H', into the
+    // output hash
+    block *blocks    = (block*)ctx->work_area;
+    u32    lane_size = ctx->nb_blocks / ctx->nb_lanes;
+    block  last;
+    copy_block(&last, blocks + lane_size - 1);
+    FOR (lane, 1, ctx->nb_lanes) {
+        xor_block(&last, blocks + (lane + 1) * lane_size - 1);
+    }
     u8 final_block[1024];
-    store_block(final_block, blocks + (nb_blocks - 1));
-    extended_hash(hash, hash_size, final_block, 1024);
+    store_block(final_block, &last);
+    extended_hash(hash, ctx->hash_size, final_block, 1024);
     WIPE_BUFFER(final_block);
+    wipe_block(&last);
 
     // wipe work area
-    volatile u64 *p = (u64*)work_area;
-    FOR (i, 0, 128 * nb_blocks) {
-        p[i] = 0;
+    crypto_wipe(ctx->work_area, (size_t)ctx->nb_blocks * 1024);
+    WIPE_CTX(ctx);
+}
+
+void crypto_argon2_general(u8       *hash,      u32 hash_size,
+                           u32 algorithm,
+                           void     *work_area, u32 nb_blocks,
+                           u32 nb_iterations,
+                           const u8 *password,  u32 password_size,
+                           const u8 *salt,      u32 salt_size,
+                           const u8 *key,       u32 key_size,
+                           const u8 *ad,        u32 ad_size)
+{
+    crypto_argon2_ctx ctx;
+    crypto_argon2_start(&ctx, algorithm, hash_size, work_area, nb_blocks,
+                        nb_iterations, 1, // 1 lane
+                        password, password_size, salt, salt_size,
+                        key, key_size, ad, ad_size);
+    FOR (pass_number, 0, nb_iterations) {
+        FOR (slice, 0, 4) {
+            crypto_argon2_fill_segment(&ctx, (u32)pass_number, (u32)slice,
+                                       0);
+        }
     }
+    crypto_argon2_finish(&ctx, hash);
+}
+
+void crypto_argon2i_general(u8       *hash,      u32 hash_size,
+                            void     *work_area, u32 nb_blocks,
+                            u32 nb_iterations,
+                            const u8 *password,  u32 password_size,
+                            const u8 *salt,      u32 salt_size,
+                            const u8 *key,       u32 key_size,
+                            const u8 *ad,        u32 ad_size)
+{
+    crypto_argon2_general(hash, hash_size, CRYPTO_ARGON2_I,
+                          work_area, nb_blocks, nb_iterations,
+                          password, password_size,
+                          salt    , salt_size,
+                          key     , key_size,
+                          ad      , ad_size);
 }
 
 void crypto_argon2i(u8       *hash,      u32 hash_size,
@@ -991,11 +2291,37 @@ void crypto_argon2i(u8       *hash,      u32 hash_size,
                     const u8 *password,  u32 password_size,
                     const u8 *salt,      u32 salt_size)
 {
-    crypto_argon2i_general(hash, hash_size,
-                           work_area, nb_blocks, nb_iterations,
-                           password, password_size,
-                           salt    , salt_size,
-                           0, 0, 0, 0);
+    crypto_argon2_general(hash, hash_size, CRYPTO_ARGON2_I,
+                          work_area, nb_blocks, nb_iterations,
+                          password, password_size,
+                          salt    , salt_size,
+                          0, 0, 0, 0);
+}
+
+void crypto_argon2d(u8       *hash,      u32 hash_size,
+                    void     *work_area, u32 nb_blocks,
+                    u32 nb_iterations,
+                    const u8 *password,  u32 password_size,
+                    const u8 *salt,      u32 salt_size)
+{
+    crypto_argon2_general(hash, hash_size, CRYPTO_ARGON2_D,
+                          work_area, nb_blocks, nb_iterations,
+                          password, password_size,
+                          salt    , salt_size,
+                          0, 0, 0, 0);
+}
+
+void crypto_argon2id(u8       *hash,      u32 hash_size,
+                     void     *work_area, u32 nb_blocks,
+                     u32 nb_iterations,
+                     const u8 *password,  u32 password_size,
+                     const u8 *salt,      u32 salt_size)
+{
+    crypto_argon2_general(hash, hash_size, CRYPTO_ARGON2_ID,
+                          work_area, nb_blocks, nb_iterations,
+                          password, password_size,
+                          salt    , salt_size,
+                          0, 0, 0, 0);
 }
 
 
@@ -2010,11 +3336,32 @@ void crypto_lock_auth_message(crypto_lock_ctx *ctx,
     crypto_poly1305_update(&ctx->poly, cipher_text, text_size);
 }
 
+// The message is encrypted and authenticated chunk by chunk, so each
+// chunk is still in the L1 cache when the second pass reads it.  This
+// is a multiple of 1024, so vectorised Chacha20 never stops in the
+// middle of a batch.
+#define LOCK_CHUNK 8192
+
+// Where the next chunk ends: past the rest of the Chacha20 pool, then
+// LOCK_CHUNK bytes, so that chunks are aligned with Chacha20 blocks.
+static size_t lock_chunk_size(crypto_lock_ctx *ctx, size_t text_size)
+{
+    return MIN(ALIGN(ctx->chacha.pool_idx, 64) + LOCK_CHUNK, text_size);
+}
+
 void crypto_lock_update(crypto_lock_ctx *ctx, u8 *cipher_text,
                         const u8 *plain_text, size_t text_size)
 {
-    crypto_chacha20_encrypt(&ctx->chacha, cipher_text, plain_text, text_size);
-    crypto_lock_auth_message(ctx, cipher_text, text_size);
+    while (text_size > 0) {
+        size_t chunk = lock_chunk_size(ctx, text_size);
+        crypto_chacha20_encrypt(&ctx->chacha, cipher_text, plain_text, chunk);
+        crypto_lock_auth_message(ctx, cipher_text, chunk);
+        if (plain_text != 0) {
+            plain_text += chunk;
+        }
+        cipher_text += chunk;
+        text_size   -= chunk;
+    }
 }
 
 void crypto_lock_final(crypto_lock_ctx *ctx, u8 mac[16])
@@ -2032,8 +3379,14 @@ void crypto_lock_final(crypto_lock_ctx *ctx, u8 mac[16])
 void crypto_unlock_update(crypto_lock_ctx *ctx, u8 *plain_text,
                           const u8 *cipher_text, size_t text_size)
 {
-    crypto_unlock_auth_message(ctx, cipher_text, text_size);
-    crypto_chacha20_encrypt(&ctx->chacha, plain_text, cipher_text, text_size);
+    while (text_size > 0) {
+        size_t chunk = lock_chunk_size(ctx, text_size);
+        crypto_unlock_auth_message(ctx, cipher_text, chunk);
+        crypto_chacha20_encrypt(&ctx->chacha, plain_text, cipher_text, chunk);
+        cipher_text += chunk;
+        plain_text  += chunk;
+        text_size   -= chunk;
+    }
 }
 
 int crypto_unlock_final(crypto_lock_ctx *ctx, const u8 mac[16])
@@ -14,7 +14,7 @@
 // Chacha20
 typedef struct {
     uint32_t input[16]; // current input, unencrypted
-    uint32_t pool [16]; // last input, encrypted
+    uint8_t  pool [64]; // last input, encrypted (key stream)
     size_t   pool_idx;  // pointer to random_pool
 } crypto_chacha_ctx;
 
@@ -41,11 +41,33 @@ typedef struct {
 typedef struct {
     uint64_t hash[8];
     uint64_t input_offset[2];
-    uint64_t input[16];
+    uint8_t  input[128];
     size_t   input_idx;
     size_t   hash_size;
+    uint64_t last_node;
 } crypto_blake2b_ctx;
 
+typedef struct {
+    crypto_blake2b_ctx leaves[4];
+    size_t             input_idx; // position in the current 512-byte stripe
+} crypto_blake2bp_ctx;
+
+// Argon2 variants
+#define CRYPTO_ARGON2_D  0 // data dependent: fastest, but leaks timings
+#define CRYPTO_ARGON2_I  1 // data independent: no timing leaks
+#define CRYPTO_ARGON2_ID 2 // independent for the first half pass only
+
+// Argon2 (any variant), with several lanes
+typedef struct {
+    void           *work_area;
+    uint32_t        hash_size;
+    uint32_t        nb_blocks; // rounded down to a multiple of 4 * nb_lanes
+    uint32_t        nb_iterations;
+    uint32_t        nb_lanes;
+    uint32_t        algorithm; // CRYPTO_ARGON2_D, _I, or _ID
+    const uint32_t *indices;   // precomputed reference indices, or null
+} crypto_argon2_ctx;
+
 // Signatures (EdDSA)
 #ifdef ED25519_SHA512
     #include "sha512.h"
@@ -159,14 +181,64 @@ void crypto_blake2b_final (crypto_blake2b_ctx *ctx, uint8_t *hash);
 void crypto_blake2b_general_init(crypto_blake2b_ctx *ctx, size_t hash_size,
                                  const uint8_t      *key, size_t key_size);
 
+// Multi-buffer interface
+// Hashes 4 (or 8) independent messages at once, one per SIMD lane.
+// Messages may have different sizes.  Same as calling
+// crypto_blake2b_general() on each message, without key.
+void crypto_blake2b_x4(uint8_t *hash[4], size_t hash_size,
+                       const uint8_t *message[4], const size_t message_size[4]);
+void crypto_blake2b_x8(uint8_t *hash[8], size_t hash_size,
+                       const uint8_t *message[8], const size_t message_size[8]);
+
+// Tree hashing interface
+// Parameters are those of the Blake2 specification.  No key.
+void crypto_blake2b_tree_init(crypto_blake2b_ctx *ctx, size_t hash_size,
+                              uint8_t  fanout     , uint8_t depth,
+                              uint32_t leaf_size  ,
+                              uint64_t node_offset, uint8_t node_depth,
+                              uint8_t  inner_size , int     is_last_node);
+
+
+// Parallel hash (Blake2bp)
+// ------------------------
+// 4 Blake2b leaves hashed in parallel, combined by a root node.  Same
+// output as the reference Blake2bp (64-byte hash, no key).  Different
+// from Blake2b.
+void crypto_blake2bp(uint8_t hash[64],
+                     const uint8_t *message, size_t message_size);
+
+void crypto_blake2bp_init  (crypto_blake2bp_ctx *ctx);
+void crypto_blake2bp_update(crypto_blake2bp_ctx *ctx,
+                            const uint8_t *message, size_t message_size);
+void crypto_blake2bp_final (crypto_blake2bp_ctx *ctx, uint8_t hash[64]);
+
+// Same as crypto_blake2bp_update(), split by leaf so each leaf can be
+// fed by its own thread.  Call crypto_blake2bp_update_leaf() for leaves
+// 0 to 3 with the same message (in any order, possibly concurrently),
+// then crypto_blake2bp_update_done() once they have all returned.
+void crypto_blake2bp_update_leaf(crypto_blake2bp_ctx *ctx, unsigned leaf,
+                                 const uint8_t *message, size_t message_size);
+void crypto_blake2bp_update_done(crypto_blake2bp_ctx *ctx,
+                                 size_t message_size);
+
 
-// Password key derivation (Argon2 i)
-// ----------------------------------
+// Password key derivation (Argon2 i, d, and id)
+// ---------------------------------------------
 void crypto_argon2i(uint8_t       *hash,      uint32_t hash_size,     // >= 4
                     void          *work_area, uint32_t nb_blocks,     // >= 8
                     uint32_t       nb_iterations,                     // >= 1
                     const uint8_t *password,  uint32_t password_size,
                     const uint8_t *salt,      uint32_t salt_size);
+void crypto_argon2d(uint8_t       *hash,      uint32_t hash_size,     // >= 4
+                    void          *work_area, uint32_t nb_blocks,     // >= 8
+                    uint32_t       nb_iterations,                     // >= 1
+                    const uint8_t *password,  uint32_t password_size,
+                    const uint8_t *salt,      uint32_t salt_size);
+void crypto_argon2id(uint8_t       *hash,      uint32_t hash_size,    // >= 4
+                     void          *work_area, uint32_t nb_blocks,    // >= 8
+                     uint32_t       nb_iterations,                    // >= 1
+                     const uint8_t *password,  uint32_t password_size,
+                     const uint8_t *salt,      uint32_t salt_size);
 
 void crypto_argon2i_general(uint8_t       *hash,      uint32_t hash_size,// >= 4
                             void          *work_area, uint32_t nb_blocks,// >= 8
@@ -176,6 +248,55 @@ void crypto_argon2i_general(uint8_t       *hash,      uint32_t hash_size,// >= 4
                             const uint8_t *key,       uint32_t key_size,
                             const uint8_t *ad,        uint32_t ad_size);
 
+// algorithm is CRYPTO_ARGON2_D, CRYPTO_ARGON2_I, or CRYPTO_ARGON2_ID
+void crypto_argon2_general(uint8_t       *hash,      uint32_t hash_size,// >= 4
+                           uint32_t       algorithm,
+                           void          *work_area, uint32_t nb_blocks,// >= 8
+                           uint32_t       nb_iterations,                // >= 1
+                           const uint8_t *password,  uint32_t password_size,
+                           const uint8_t *salt,      uint32_t salt_size,// >= 8
+                           const uint8_t *key,       uint32_t key_size,
+                           const uint8_t *ad,        uint32_t ad_size);
+
+// Parallel interface (Argon2 lanes, p > 1)
+// Memory is split in nb_lanes lanes, each cut in 4 segments per pass.
+// Every pass, call crypto_argon2_fill_segment() for each slice (0 to
+// 3) and each lane.  Segments of the same pass and slice are
+// independent: they can be filled concurrently, by separate threads.
+// A slice must be complete before the next one starts.
+// nb_blocks must be at least 8 * nb_lanes.
+// crypto_argon2i_start() is crypto_argon2_start() with CRYPTO_ARGON2_I.
+// The other functions work with all variants.
+void crypto_argon2_start(crypto_argon2_ctx *ctx, uint32_t algorithm,
+                         uint32_t       hash_size,
+                         void          *work_area, uint32_t nb_blocks,
+                         uint32_t       nb_iterations, uint32_t nb_lanes,
+                         const uint8_t *password,  uint32_t password_size,
+                         const uint8_t *salt,      uint32_t salt_size,
+                         const uint8_t *key,       uint32_t key_size,
+                         const uint8_t *ad,        uint32_t ad_size);
+void crypto_argon2i_start(crypto_argon2_ctx *ctx, uint32_t hash_size,
+                          void          *work_area, uint32_t nb_blocks,
+                          uint32_t       nb_iterations, uint32_t nb_lanes,
+                          const uint8_t *password,  uint32_t password_size,
+                          const uint8_t *salt,      uint32_t salt_size,
+                          const uint8_t *key,       uint32_t key_size,
+                          const uint8_t *ad,        uint32_t ad_size);
+void crypto_argon2_fill_segment(const crypto_argon2_ctx *ctx,
+                                uint32_t pass_number, uint32_t slice,
+                                uint32_t lane);
+void crypto_argon2_finish(crypto_argon2_ctx *ctx, uint8_t *hash);
+
+// Argon2i reference indices only depend on the parameters, not on the
+// password.  When hashing many passwords with the same nb_blocks,
+// nb_iterations and nb_lanes, compute them once, then point
+// ctx->indices to the table after each crypto_argon2i_start().
+// (It is reset to null, meaning "compute them on the fly".)
+// Other variants ignore the table.
+// The table needs room for nb_blocks * nb_iterations words.
+void crypto_argon2i_indices(uint32_t *indices,       uint32_t nb_blocks,
+                            uint32_t  nb_iterations, uint32_t nb_lanes);
+
 
 // Key exchange (x25519 + HChacha20)
 // ---------------------------------
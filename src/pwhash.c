@@ -1,9 +1,13 @@
+#define _GNU_SOURCE // getline(), clock_gettime()
 #include "monocypher.h"
 #include "getopt.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <bsd/readpassphrase.h>
 
 static vector parse_key(getopt_ctx *ctx) {
@@ -56,6 +60,115 @@ static int parse_nb_it(getopt_ctx *ctx)
     return l;
 }
 
+static int parse_lanes(getopt_ctx *ctx)
+{
+    int l = int_of_string(getopt_parameter(ctx));
+    if (l == -1) error("unspecified number of lanes"              );
+    if (l == -2) error("number of lanes is not a decimal integer.");
+    if (l == -3) error("too many lanes"                           );
+    if (l  <  1) error("not enough lanes (>= 1)"                  );
+    return l;
+}
+
+static uint32_t parse_variant(getopt_ctx *ctx)
+{
+    const char *variant = getopt_parameter(ctx);
+    if (variant == 0) {
+        error("unspecified Argon2 variant");
+    }
+    if (string_equal(variant, "i" )) { return CRYPTO_ARGON2_I;  }
+    if (string_equal(variant, "d" )) { return CRYPTO_ARGON2_D;  }
+    if (string_equal(variant, "id")) { return CRYPTO_ARGON2_ID; }
+    error("Argon2 variant must be i, d, or id");
+    return 0; // impossible
+}
+
+static int parse_workers(getopt_ctx *ctx)
+{
+    int l = int_of_string(getopt_parameter(ctx));
+    if (l == -1) error("unspecified number of workers"              );
+    if (l == -2) error("number of workers is not a decimal integer.");
+    if (l == -3) error("too many workers"                           );
+    if (l  <  1) error("not enough workers (>= 1)"                  );
+    return l;
+}
+
+static size_t parse_budget(getopt_ctx *ctx)
+{
+    size_t size;
+    int code = size_of_string(&size, getopt_parameter(ctx));
+    if (code == -1) error("unspecified memory budget"                  );
+    if (code == -2) error("memory budget is not a size (like 1G, 512M)");
+    if (code == -3) error("memory budget too big"                      );
+    return size;
+}
+
+// Argon2 parameters, from the command line
+typedef struct {
+    size_t   digest_size;
+    uint32_t nb_iterations;
+    uint32_t nb_kibybytes;
+    uint32_t nb_lanes;
+    uint32_t variant;
+    vector   key;
+    vector   ad;
+} argon2_params;
+
+// The threads live for the whole hash.  Thread i fills lanes i,
+// i + nb_threads... of each slice, then waits at the barrier for the
+// others before the next slice.
+typedef struct {
+    const crypto_argon2_ctx *ctx;
+    size_t                   nb_threads;
+    pthread_barrier_t        slice_done;
+} lanes_work;
+
+static void lanes_job(void *work_ptr, size_t thread)
+{
+    lanes_work *w = (lanes_work*)work_ptr;
+    const crypto_argon2_ctx *ctx = w->ctx;
+    for (uint32_t pass_number = 0; pass_number < ctx->nb_iterations;
+         pass_number++) {
+        for (uint32_t slice = 0; slice < 4; slice++) {
+            for (size_t lane = thread; lane < ctx->nb_lanes;
+                 lane += w->nb_threads) {
+                crypto_argon2_fill_segment(ctx, pass_number, slice,
+                                           (uint32_t)lane);
+            }
+            pthread_barrier_wait(&w->slice_done);
+        }
+    }
+}
+
+// Hashes a password, filling the lanes of each slice with up to
+// nb_threads threads.  indices is an Argon2i index table, or null.
+// The password may live in the work area.
+static void hash_password(uint8_t *digest, const argon2_params *p,
+                          void *work_area, const uint32_t *indices,
+                          const uint8_t *password, size_t password_size,
+                          const vector  *salt,     size_t nb_threads)
+{
+    crypto_argon2_ctx ctx;
+    crypto_argon2_start(&ctx, p->variant, (uint32_t)p->digest_size,
+                        work_area, p->nb_kibybytes,
+                        p->nb_iterations, p->nb_lanes,
+                        password, (uint32_t)password_size,
+                        salt->buffer , (uint32_t)salt->size,
+                        p->key.buffer, (uint32_t)p->key.size,
+                        p->ad .buffer, (uint32_t)p->ad .size);
+    ctx.indices = indices;
+    lanes_work w;
+    w.ctx        = &ctx;
+    w.nb_threads = nb_threads < p->nb_lanes ? nb_threads : p->nb_lanes;
+    if (w.nb_threads < 1) { w.nb_threads = 1; }
+    // One job per thread: every job runs at once, since none of them
+    // can finish before they all reach the barrier.
+    pthread_barrier_init(&w.slice_done, 0, (unsigned)w.nb_threads);
+    parallel_for(w.nb_threads, w.nb_threads, lanes_job, &w);
+    pthread_barrier_destroy(&w.slice_done);
+    crypto_argon2_finish(&ctx, digest);
+}
+
 static vector parse_salt(getopt_ctx *ctx)
 {
     if (ctx->argc == 0) error("Missing salt"      );
@@ -69,43 +182,516 @@ static vector parse_salt(getopt_ctx *ctx)
     return salt;
 }
 
+// Server mode: one request per line on the standard input, one
+// response per line on the standard output.  Arguments are hexadecimal.
+//     hash   <id> <salt> <password>           -> <id> ok <digest>
+//     verify <id> <salt> <password> <digest>  -> <id> ok, or <id> mismatch
+//     stats                                   -> stats <name>=<value>...
+// Malformed requests get "<id> error <reason>".  Responses come in
+// completion order.  All requests share the command line parameters.
+typedef struct {
+    char   *id;
+    int     verify;
+    vector  salt;
+    vector  password;
+    vector  digest;  // expected digest (verify only)
+    double  arrival; // seconds
+} request;
+
+#define QUEUE_SIZE 64
+
+typedef struct {
+    const argon2_params *params;
+    const uint32_t      *indices;   // Argon2i index table, or null
+    area_pool            pool;      // enforces the memory budget
+    pthread_mutex_t      output_lock;
+
+    // Everything below is protected by lock
+    pthread_mutex_t      lock;
+    pthread_cond_t       not_empty;
+    pthread_cond_t       not_full;
+    request              queue[QUEUE_SIZE];
+    size_t               queue_start;
+    size_t               nb_queued;
+    int                  closed;    // no more requests
+    size_t               nb_waiting; // dequeued, waiting for memory
+    size_t               nb_running;
+    size_t               nb_done;
+    size_t               nb_errors;
+    double               total_latency;
+    double               max_latency;
+} server;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void free_request(request *r)
+{
+    crypto_wipe(r->password.buffer, r->password.size);
+    free(r->id);
+    free_vector(&r->salt    );
+    free_vector(&r->password);
+    free_vector(&r->digest  );
+}
+
+// Next space separated word of a line (modifies the line), or 0
+static char* next_word(char **line)
+{
+    char *word = *line;
+    while (*word == ' ') { word++; }
+    if (*word == '\0') { return 0; }
+    char *end = word;
+    while (*end != ' ' && *end != '\0') { end++; }
+    if (*end == ' ') { *end++ = '\0'; }
+    *line = end;
+    return word;
+}
+
+// Prints "<id> <status> [<message>]"
+static void respond(server *s, const char *id, const char *status,
+                    const char *message)
+{
+    pthread_mutex_lock(&s->output_lock);
+    if (message != 0) { printf("%s %s %s\n", id, status, message); }
+    else              { printf("%s %s\n"   , id, status         ); }
+    fflush(stdout);
+    pthread_mutex_unlock(&s->output_lock);
+}
+
+static void print_stats(server *s)
+{
+    pthread_mutex_lock(&s->lock);
+    size_t nb_done     = s->nb_done;
+    double avg_latency = nb_done == 0 ? 0 : s->total_latency / nb_done;
+    pthread_mutex_lock(&s->output_lock);
+    printf("stats queued=%zu waiting=%zu running=%zu done=%zu errors=%zu"
+           " avg_ms=%.1f max_ms=%.1f\n",
+           s->nb_queued, s->nb_waiting, s->nb_running, nb_done, s->nb_errors,
+           avg_latency * 1000, s->max_latency * 1000);
+    fflush(stdout);
+    pthread_mutex_unlock(&s->output_lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Parses the arguments of a request.
+// Returns 0 on success, or an error message.
+static const char* parse_request(request *r, const char *command,
+                                 char *args, const server *s)
+{
+    const char *id       = next_word(&args);
+    const char *salt     = next_word(&args);
+    const char *password = next_word(&args);
+    const char *digest   = next_word(&args);
+    if (id == 0) { id = "-"; }
+    r->verify   = string_equal(command, "verify");
+    r->id       = alloc(strlen(id) + 1);
+    r->salt     = new_vector();
+    r->password = new_vector();
+    r->digest   = new_vector();
+    r->arrival  = now();
+    strcpy(r->id, id);
+    if (!r->verify && !string_equal(command, "hash")) {
+        return "unknown command (hash, verify, or stats)";
+    }
+    if (password == 0                      ) { return "missing arguments";  }
+    if (r->verify  && digest == 0          ) { return "missing digest";     }
+    if (!r->verify && digest != 0          ) { return "too many arguments"; }
+    if (next_word(&args) != 0              ) { return "too many arguments"; }
+    if (read_vector(&r->salt    , salt    )) { return "malformed salt";     }
+    if (read_vector(&r->password, password)) { return "malformed password"; }
+    if (r->salt.size < 8                   ) { return "salt too short";     }
+    if (r->verify) {
+        if (read_vector(&r->digest, digest)) { return "malformed digest"; }
+        if (r->digest.size != s->params->digest_size) {
+            return "wrong digest size";
+        }
+    }
+    return 0;
+}
+
+static void read_requests(server *s)
+{
+    char   *line = 0;
+    size_t  line_capacity = 0;
+    ssize_t line_size;
+    while ((line_size = getline(&line, &line_capacity, stdin)) != -1) {
+        if (line_size > 0 && line[line_size - 1] == '\n') {
+            line[line_size - 1] = '\0';
+        }
+        char       *args    = line;
+        const char *command = next_word(&args);
+        if (command == 0) {
+            continue; // blank line
+        }
+        if (string_equal(command, "stats")) {
+            print_stats(s);
+            continue;
+        }
+        request     r;
+        const char *err = parse_request(&r, command, args, s);
+        crypto_wipe(line, line_capacity); // hex password
+        if (err != 0) {
+            pthread_mutex_lock(&s->lock);
+            s->nb_errors++;
+            pthread_mutex_unlock(&s->lock);
+            respond(s, r.id, "error", err);
+            free_request(&r);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        while (s->nb_queued == QUEUE_SIZE) {
+            pthread_cond_wait(&s->not_full, &s->lock);
+        }
+        s->queue[(s->queue_start + s->nb_queued) % QUEUE_SIZE] = r;
+        s->nb_queued++;
+        pthread_cond_signal(&s->not_empty);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(line);
+    pthread_mutex_lock(&s->lock);
+    s->closed = 1;
+    pthread_cond_broadcast(&s->not_empty);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Takes the oldest request.  Returns 0 once there are no more requests.
+static int next_request(server *s, request *r)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->nb_queued == 0 && !s->closed) {
+        pthread_cond_wait(&s->not_empty, &s->lock);
+    }
+    int found = s->nb_queued > 0;
+    if (found) {
+        *r = s->queue[s->queue_start];
+        s->queue_start = (s->queue_start + 1) % QUEUE_SIZE;
+        s->nb_queued--;
+        s->nb_waiting++;
+        pthread_cond_signal(&s->not_full);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+static void serve_request(server *s, request *r)
+{
+    const argon2_params *p      = s->params;
+    uint8_t             *digest = alloc(p->digest_size);
+
+    // Waits until the memory budget allows one more work area
+    void *work_area = pool_acquire(&s->pool);
+    pthread_mutex_lock(&s->lock);
+    s->nb_waiting--;
+    s->nb_running++;
+    pthread_mutex_unlock(&s->lock);
+
+    hash_password(digest, p, work_area, s->indices,
+                  r->password.buffer, r->password.size, &r->salt, 1);
+    pool_release(&s->pool, work_area); // wiped by crypto_argon2_finish()
+
+    if (r->verify) {
+        uint8_t diff = 0; // constant time comparison
+        for (size_t i = 0; i < p->digest_size; i++) {
+            diff |= digest[i] ^ r->digest.buffer[i];
+        }
+        respond(s, r->id, diff == 0 ? "ok" : "mismatch", 0);
+    } else {
+        char *hex = alloc(p->digest_size * 2 + 1);
+        for (size_t i = 0; i < p->digest_size; i++) {
+            sprintf(hex + i * 2, "%02x", digest[i]);
+        }
+        respond(s, r->id, "ok", hex);
+        free(hex);
+    }
+
+    double latency = now() - r->arrival;
+    pthread_mutex_lock(&s->lock);
+    s->nb_running--;
+    s->nb_done++;
+    s->total_latency += latency;
+    if (latency > s->max_latency) { s->max_latency = latency; }
+    pthread_mutex_unlock(&s->lock);
+    crypto_wipe(digest, p->digest_size);
+    free(digest);
+    free_request(r);
+}
+
+// Job 0 reads the requests, the others serve them
+static void server_job(void *server_ptr, size_t i)
+{
+    server *s = (server*)server_ptr;
+    if (i == 0) {
+        read_requests(s);
+        return;
+    }
+    request r;
+    while (next_request(s, &r)) {
+        serve_request(s, &r);
+    }
+}
+
+static void run_server(const argon2_params *p, size_t nb_workers,
+                       size_t memory_budget)
+{
+    size_t work_size = 1024 * (size_t)p->nb_kibybytes;
+    size_t nb_areas  = memory_budget / work_size;
+    if (nb_areas == 0) {
+        error("memory budget too small for a single work area");
+    }
+    if (nb_areas > nb_workers) { nb_areas = nb_workers; }
+
+    server s;
+    s.params        = p;
+    s.indices       = 0;
+    s.queue_start   = 0;
+    s.nb_queued     = 0;
+    s.closed        = 0;
+    s.nb_waiting    = 0;
+    s.nb_running    = 0;
+    s.nb_done       = 0;
+    s.nb_errors     = 0;
+    s.total_latency = 0;
+    s.max_latency   = 0;
+    pthread_mutex_init(&s.output_lock, 0);
+    pthread_mutex_init(&s.lock, 0);
+    pthread_cond_init(&s.not_empty, 0);
+    pthread_cond_init(&s.not_full , 0);
+    pool_init(&s.pool, work_size, nb_areas, nb_workers);
+
+    // Argon2i references are the same for every request
+    uint32_t *indices = 0;
+    if (p->variant == CRYPTO_ARGON2_I) {
+        indices = alloc((size_t)p->nb_kibybytes * p->nb_iterations
+                        * sizeof(uint32_t));
+        crypto_argon2i_indices(indices, p->nb_kibybytes, p->nb_iterations,
+                               p->nb_lanes);
+        s.indices = indices;
+    }
+
+    parallel_for(nb_workers + 1, nb_workers + 1, server_job, &s);
+
+    free(indices);
+    pool_free(&s.pool);
+    pthread_cond_destroy(&s.not_full );
+    pthread_cond_destroy(&s.not_empty);
+    pthread_mutex_destroy(&s.lock);
+    pthread_mutex_destroy(&s.output_lock);
+}
+
+static int parse_target(getopt_ctx *ctx)
+{
+    int l = int_of_string(getopt_parameter(ctx));
+    if (l == -1) error("unspecified target latency"              );
+    if (l == -2) error("target latency is not a decimal integer.");
+    if (l == -3) error("target latency too big"                  );
+    if (l  <  1) error("target latency too small (>= 1 ms)"      );
+    return l;
+}
+
+// Times one hash, in seconds (best of 2).  Prints the measurement.
+static double time_hash(const argon2_params *p)
+{
+    static const uint8_t password[8] = "password";
+    uint8_t salt_buffer[16] = {0};
+    uint8_t digest     [64];
+    vector  salt;
+    salt.buffer = salt_buffer;
+    salt.size   = sizeof(salt_buffer);
+    argon2_params q = *p;
+    q.digest_size   = sizeof(digest);
+
+    size_t size      = (size_t)p->nb_kibybytes << 10;
+    void  *work_area = alloc_pages(size);
+    touch_pages(work_area, size); // page faults are not part of the test
+    double best = 0;
+    for (int i = 0; i < 2; i++) {
+        double start = now();
+        hash_password(digest, &q, work_area, 0,
+                      password, sizeof(password), &salt, q.nb_lanes);
+        double t = now() - start;
+        if (i == 0 || t < best) { best = t; }
+    }
+    free_pages(work_area, size);
+    printf("%6u %7u %11u %10.1f %8.0f\n",
+           p->nb_lanes, p->nb_iterations, p->nb_kibybytes >> 10,
+           best * 1000, (p->nb_kibybytes >> 10) * p->nb_iterations / best);
+    return best;
+}
+
+// Largest memory (in KiB, whole MiB) that hashes within target
+// seconds, or 0 if even 8 MiB is too slow.  Doubles the memory until
+// it gets too slow, then extrapolates (time is about linear in
+// memory), and checks.
+static uint32_t calibrate_memory(argon2_params *p, double target)
+{
+    static const uint32_t max_kib = 2 << 20; // 2 GiB
+    uint32_t best_kib  = 0;
+    double   best_time = 0;
+    for (uint32_t kib = 8 << 10; kib <= max_kib; kib *= 2) {
+        p->nb_kibybytes = kib;
+        double t = time_hash(p);
+        if (t > target) { break; }
+        best_kib  = kib;
+        best_time = t;
+    }
+    if (best_kib == 0 || best_kib == max_kib) {
+        return best_kib;
+    }
+    // Extrapolate, round down to whole MiB.  Bigger areas tend to be
+    // a bit slower: shrink until the target is met.
+    double scale = target / best_time;
+    for (int i = 0; i < 4; i++) {
+        uint32_t kib = (uint32_t)(best_kib * scale * 0.98) >> 10 << 10;
+        if (kib <= best_kib) { break; }
+        p->nb_kibybytes = kib;
+        double t = time_hash(p);
+        if (t <= target) { return kib; }
+        scale = scale * target / t;
+    }
+    return best_kib;
+}
+
+// Recommends the most memory hard parameters that hash within
+// target_ms, on this machine.  Argon2i gets at least 3 passes.
+static void calibrate(argon2_params *p, int target_ms)
+{
+    double   target  = target_ms / 1000.0;
+    long     nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t lanes[2];
+    size_t   nb_lanes_tried = 0;
+    lanes[nb_lanes_tried++] = p->nb_lanes;
+    if (nb_cpus > 1 && (uint32_t)nb_cpus != p->nb_lanes) {
+        lanes[nb_lanes_tried++] = (uint32_t)nb_cpus;
+    }
+    uint32_t min_passes = p->variant == CRYPTO_ARGON2_I ? 3 : 1;
+
+    argon2_params best = *p;
+    uint64_t      best_cost = 0;
+    printf("target: %d ms\n", target_ms);
+    printf(" lanes  passes  memory_MiB    time_ms    MiB/s\n");
+    for (size_t i = 0; i < nb_lanes_tried; i++) {
+        for (uint32_t passes = min_passes; passes <= min_passes + 3; passes++) {
+            argon2_params q = *p;
+            q.nb_lanes      = lanes[i];
+            q.nb_iterations = passes;
+            uint32_t kib    = calibrate_memory(&q, target);
+            // cost: memory first, then passes
+            uint64_t cost   = ((uint64_t)kib << 8) + passes;
+            if (kib != 0 && cost > best_cost) {
+                best              = q;
+                best.nb_kibybytes = kib;
+                best_cost         = cost;
+            }
+        }
+    }
+    if (best_cost == 0) {
+        printf("Could not hash 8 MiB within %d ms\n", target_ms);
+        return;
+    }
+    static const char *variants[3] = { "d", "i", "id" };
+    printf("recommended: -y %s -t %u -m %u -p %u  (%u MiB)\n",
+           variants[best.variant], best.nb_iterations, best.nb_kibybytes,
+           best.nb_lanes, best.nb_kibybytes >> 10);
+}
+
 int main(int argc, char* argv[])
 {
-    size_t   digest_size   = 64;
-    uint32_t nb_iterations = 3;
-    uint32_t nb_kibybytes  = 102400; // 100 Mib
-    vector   key           = new_vector();
-    vector   ad            = new_vector();
-    int      rpp_flags     = 0;
+    argon2_params p;
+    p.digest_size   = 64;
+    p.nb_iterations = 3;
+    p.nb_kibybytes  = 102400; // 100 Mib
+    p.nb_lanes      = 1;
+    p.variant       = CRYPTO_ARGON2_I;
+    p.key           = new_vector();
+    p.ad            = new_vector();
+    int    rpp_flags     = 0;
+    int    server_mode   = 0;
+    int    calibrating   = 0;
+    int    target_ms     = 250;
+    size_t nb_workers    = 1;
+    size_t memory_budget = 0; // enough for every worker
 
     set_usage_string(
         "Usage: pwhash [OPTION]... salt\n"
+        "       pwhash [OPTION]... --server\n"
+        "       pwhash [OPTION]... --calibrate\n"
         "Read the password from standard input\n"
         "The salt must be at least 8 bytes long (16 hex digits)\n"
         "\n"
         "-l --digest-size      digest length in bytes (32 bytes by default)\n"
         "-t --nb-iterations    number of iterations (default 3)\n"
         "-m --nb-kilobytes     memory usage in KiB (default 100MiB)\n"
+        "-p --nb-lanes         parallelism: number of lanes, each filled\n"
+        "                      by its own thread (default 1)\n"
+        "-y --variant          Argon2 variant: i, d, or id (default i)\n"
         "-k --key              secret key (hexadecimal, default none)\n"
         "-a --additional-data  additionnal data (hexadecimal, default none)\n"
-        "-i --stdin            read password from stdin"
+        "-i --stdin            read password from stdin\n"
+        "-s --server           serve requests, one per line, from stdin:\n"
+        "                        hash   <id> <salt> <password>\n"
+        "                        verify <id> <salt> <password> <digest>\n"
+        "                        stats\n"
+        "                      (hexadecimal arguments; in server mode,\n"
+        "                      the lanes of a hash share one thread)\n"
+        "-w --nb-workers       server mode: concurrent hashes (default 1)\n"
+        "-M --memory-budget    server mode: memory for all work areas,\n"
+        "                      with K, M, or G suffix (default: enough\n"
+        "                      for every worker)\n"
+        "-c --calibrate        benchmark this machine, and recommend\n"
+        "                      -t -m and -p for the target latency\n"
+        "-T --target           calibration target, in ms (default 250)\n"
         "-? --help             display this help and exit\n");
 
     // Parse and validate arguments
     getopt_ctx ctx;
     OPT_BEGIN(ctx, argc, argv);
-    OPT('l', "digest-size"    );  digest_size   = parse_digest(&ctx);
-    OPT('t', "nb-iterations"  );  nb_iterations = parse_nb_it (&ctx);
-    OPT('k', "nb-kilobytes"   );  nb_kibybytes  = parse_kib   (&ctx);
-    OPT('k', "key"            );  key           = parse_key   (&ctx);
-    OPT('a', "additional-data");  ad            = parse_ad    (&ctx);
-    OPT('i', "stdin"          );  rpp_flags    |= RPP_STDIN;
+    OPT('l', "digest-size"    );  p.digest_size   = parse_digest (&ctx);
+    OPT('t', "nb-iterations"  );  p.nb_iterations = parse_nb_it  (&ctx);
+    OPT('m', "nb-kilobytes"   );  p.nb_kibybytes  = parse_kib    (&ctx);
+    OPT('p', "nb-lanes"       );  p.nb_lanes      = parse_lanes  (&ctx);
+    OPT('y', "variant"        );  p.variant       = parse_variant(&ctx);
+    OPT('k', "key"            );  p.key           = parse_key    (&ctx);
+    OPT('a', "additional-data");  p.ad            = parse_ad     (&ctx);
+    OPT('i', "stdin"          );  rpp_flags      |= RPP_STDIN;
+    OPT('s', "server"         );  server_mode     = 1;
+    OPT('w', "nb-workers"     );  nb_workers      = parse_workers(&ctx);
+    OPT('M', "memory-budget"  );  memory_budget   = parse_budget (&ctx);
+    OPT('c', "calibrate"      );  calibrating     = 1;
+    OPT('T', "target"         );  target_ms       = parse_target (&ctx);
     OPT('?', "help"           );  usage();
     OPT_END;
-    vector   salt      = parse_salt(&ctx);
-    size_t   work_size = 1024 * nb_kibybytes;
-    void    *work_area = alloc(work_size);
-    uint8_t *digest    = alloc(digest_size);
+    if (p.nb_kibybytes / 8 < p.nb_lanes) {
+        error("not enough kilobytes for that many lanes (>= 8 per lane)");
+    }
+    size_t work_size = 1024 * (size_t)p.nb_kibybytes;
+
+    if (calibrating) {
+        if (ctx.argc > 0) error("Too many arguments");
+        calibrate(&p, target_ms);
+        free_vector(&p.key);
+        free_vector(&p.ad );
+        return 0;
+    }
+    if (server_mode) {
+        if (ctx.argc > 0) error("Too many arguments");
+        if (memory_budget == 0) { memory_budget = work_size * nb_workers; }
+        run_server(&p, nb_workers, memory_budget);
+        free_vector(&p.key);
+        free_vector(&p.ad );
+        return 0;
+    }
+
+    vector   salt   = parse_salt(&ctx);
+    uint8_t *digest = alloc(p.digest_size);
+
+    // work area, faulted in by one thread per lane
+    area_pool pool;
+    pool_init(&pool, work_size, 1, p.nb_lanes);
+    void *work_area = pool_acquire(&pool);
 
     // read password
     if (readpassphrase("Passphrase: ", work_area, work_size, rpp_flags) == 0) {
@@ -114,22 +700,18 @@ int main(int argc, char* argv[])
     size_t password_size = strlen(work_area);
 
     // hash password
-    crypto_argon2i_general(digest, digest_size,
-                           work_area, nb_kibybytes,
-                           nb_iterations,
-                           work_area  , password_size,
-                           salt.buffer, salt.size,
-                           key .buffer, key .size,
-                           ad  .buffer, ad  .size);
+    hash_password(digest, &p, work_area, 0,
+                  work_area, password_size, &salt, p.nb_lanes);
 
     // free resources
-    free(work_area);
-    free_vector(&key );
-    free_vector(&ad  );
-    free_vector(&salt);
+    pool_release(&pool, work_area); // wiped by crypto_argon2_finish()
+    pool_free(&pool);
+    free_vector(&p.key);
+    free_vector(&p.ad );
+    free_vector(&salt );
 
     // print password
-    print_buffer(digest, digest_size);
+    print_buffer(digest, p.digest_size);
     printf("\n");
 
     return 0;
@@ -70,41 +70,64 @@ static const u64 K[80] = {
     0x4cc5d4becb3e42b6,0x597f299cfc657e2a,0x5fcb6fab3ad6faec,0x6c44198c4a475817
 };
 
-static void sha512_compress(crypto_sha512_ctx *ctx)
+// The message schedule only ever needs the last 16 words, so it is
+// computed in place in a rolling window, as the rounds need it.
+// Rounds are unrolled 16 at a time, so every index is a constant, and
+// the variables rotate instead of being shifted.
+static void sha512_compress(crypto_sha512_ctx *ctx, const u8 block[128])
 {
-    u64 *w = ctx->w;
-    FOR(i,  0, 16) { w[i] = ctx->input[i]; }
-    FOR(i, 16, 80) { w[i] = (lit_sigma1(w[i- 2]) + w[i- 7] +
-                             lit_sigma0(w[i-15]) + w[i-16]); }
-
+    u64 w[16];
+    FOR (i, 0, 16) {
+        w[i] = load64_be(block + i*8);
+    }
     u64 a = ctx->hash[0];    u64 b = ctx->hash[1];
     u64 c = ctx->hash[2];    u64 d = ctx->hash[3];
     u64 e = ctx->hash[4];    u64 f = ctx->hash[5];
     u64 g = ctx->hash[6];    u64 h = ctx->hash[7];
-    FOR(i, 0, 80) {
-        u64 t1 = big_sigma1(e) + ch (e, f, g) + h + K[i] + w[i];
-        u64 t2 = big_sigma0(a) + maj(a, b, c);
-        h = g;  g = f;  f = e;  e = d  + t1;
-        d = c;  c = b;  b = a;  a = t1 + t2;
+
+#define SCHEDULE(i) w[i] += lit_sigma1(w[(i + 14) & 15]) + w[(i + 9) & 15] \
+                          + lit_sigma0(w[(i +  1) & 15])
+#define ROUND(a, b, c, d, e, f, g, h, i)                     \
+    h += big_sigma1(e) + ch(e, f, g) + K[j + i] + w[i];      \
+    d += h;                                                  \
+    h += big_sigma0(a) + maj(a, b, c)
+#define ROUNDS_16                                            \
+    ROUND(a, b, c, d, e, f, g, h,  0);                       \
+    ROUND(h, a, b, c, d, e, f, g,  1);                       \
+    ROUND(g, h, a, b, c, d, e, f,  2);                       \
+    ROUND(f, g, h, a, b, c, d, e,  3);                       \
+    ROUND(e, f, g, h, a, b, c, d,  4);                       \
+    ROUND(d, e, f, g, h, a, b, c,  5);                       \
+    ROUND(c, d, e, f, g, h, a, b,  6);                       \
+    ROUND(b, c, d, e, f, g, h, a,  7);                       \
+    ROUND(a, b, c, d, e, f, g, h,  8);                       \
+    ROUND(h, a, b, c, d, e, f, g,  9);                       \
+    ROUND(g, h, a, b, c, d, e, f, 10);                       \
+    ROUND(f, g, h, a, b, c, d, e, 11);                       \
+    ROUND(e, f, g, h, a, b, c, d, 12);                       \
+    ROUND(d, e, f, g, h, a, b, c, 13);                       \
+    ROUND(c, d, e, f, g, h, a, b, 14);                       \
+    ROUND(b, c, d, e, f, g, h, a, 15)
+
+    size_t j = 0;
+    ROUNDS_16;
+    for (j = 16; j < 80; j += 16) {
+        SCHEDULE( 0);  SCHEDULE( 1);  SCHEDULE( 2);  SCHEDULE( 3);
+        SCHEDULE( 4);  SCHEDULE( 5);  SCHEDULE( 6);  SCHEDULE( 7);
+        SCHEDULE( 8);  SCHEDULE( 9);  SCHEDULE(10);  SCHEDULE(11);
+        SCHEDULE(12);  SCHEDULE(13);  SCHEDULE(14);  SCHEDULE(15);
+        ROUNDS_16;
     }
+#undef SCHEDULE
+#undef ROUND
+#undef ROUNDS_16
+
     ctx->hash[0] += a;    ctx->hash[1] += b;
     ctx->hash[2] += c;    ctx->hash[3] += d;
     ctx->hash[4] += e;    ctx->hash[5] += f;
     ctx->hash[6] += g;    ctx->hash[7] += h;
 }
 
-static void sha512_set_input(crypto_sha512_ctx *ctx, u8 input)
-{
-    if (ctx->input_idx == 0) {
-        FOR (i, 0, 16) {
-            ctx->input[i] = 0;
-        }
-    }
-    size_t word = ctx->input_idx / 8;
-    size_t byte = ctx->input_idx % 8;
-    ctx->input[word] |= (u64)input << (8 * (7 - byte));
-}
-
 // increment a 128-bit "word".
 static void sha512_incr(u64 x[2], u64 y)
 {
@@ -114,22 +137,237 @@ static void sha512_incr(u64 x[2], u64 y)
     }
 }
 
-static void sha512_end_block(crypto_sha512_ctx *ctx)
+static void sha512_compress_block(crypto_sha512_ctx *ctx, const u8 *block)
 {
-    if (ctx->input_idx == 128) {
-        sha512_incr(ctx->input_size, 1024); // size is in bits
-        sha512_compress(ctx);
-        ctx->input_idx = 0;
+    sha512_incr(ctx->input_size, 1024); // size is in bits
+    sha512_compress(ctx, block);
+}
+
+// Multi-buffer compression: compresses one block for each of several
+// contexts at once, one context per lane.  Same rounds as the scalar
+// version, only wider.
+#define LANE_SCHEDULE(i)                                                \
+    w[i] = ADD(ADD(w[i], LIT_SIGMA1(w[(i + 14) & 15])),                 \
+               ADD(w[(i + 9) & 15], LIT_SIGMA0(w[(i + 1) & 15])))
+#define LANE_ROUND(a, b, c, d, e, f, g, h, i)                           \
+    h = ADD(ADD(h, ADD(BIG_SIGMA1(e), CH(e, f, g))),                    \
+            ADD(SET1(K[j + i]), w[i]));                                 \
+    d = ADD(d, h);                                                      \
+    h = ADD(h, ADD(BIG_SIGMA0(a), MAJ(a, b, c)))
+#define LANE_ROUNDS_16                                                  \
+    LANE_ROUND(a, b, c, d, e, f, g, h,  0);                             \
+    LANE_ROUND(h, a, b, c, d, e, f, g,  1);                             \
+    LANE_ROUND(g, h, a, b, c, d, e, f,  2);                             \
+    LANE_ROUND(f, g, h, a, b, c, d, e,  3);                             \
+    LANE_ROUND(e, f, g, h, a, b, c, d,  4);                             \
+    LANE_ROUND(d, e, f, g, h, a, b, c,  5);                             \
+    LANE_ROUND(c, d, e, f, g, h, a, b,  6);                             \
+    LANE_ROUND(b, c, d, e, f, g, h, a,  7);                             \
+    LANE_ROUND(a, b, c, d, e, f, g, h,  8);                             \
+    LANE_ROUND(h, a, b, c, d, e, f, g,  9);                             \
+    LANE_ROUND(g, h, a, b, c, d, e, f, 10);                             \
+    LANE_ROUND(f, g, h, a, b, c, d, e, 11);                             \
+    LANE_ROUND(e, f, g, h, a, b, c, d, 12);                             \
+    LANE_ROUND(d, e, f, g, h, a, b, c, 13);                             \
+    LANE_ROUND(c, d, e, f, g, h, a, b, 14);                             \
+    LANE_ROUND(b, c, d, e, f, g, h, a, 15)
+#define LANE_COMPRESS                                                   \
+    a = s[0];  b = s[1];  c = s[2];  d = s[3];                          \
+    e = s[4];  f = s[5];  g = s[6];  h = s[7];                          \
+    size_t j = 0;                                                       \
+    LANE_ROUNDS_16;                                                     \
+    for (j = 16; j < 80; j += 16) {                                     \
+        LANE_SCHEDULE( 0);  LANE_SCHEDULE( 1);                          \
+        LANE_SCHEDULE( 2);  LANE_SCHEDULE( 3);                          \
+        LANE_SCHEDULE( 4);  LANE_SCHEDULE( 5);                          \
+        LANE_SCHEDULE( 6);  LANE_SCHEDULE( 7);                          \
+        LANE_SCHEDULE( 8);  LANE_SCHEDULE( 9);                          \
+        LANE_SCHEDULE(10);  LANE_SCHEDULE(11);                          \
+        LANE_SCHEDULE(12);  LANE_SCHEDULE(13);                          \
+        LANE_SCHEDULE(14);  LANE_SCHEDULE(15);                          \
+        LANE_ROUNDS_16;                                                 \
+    }                                                                   \
+    s[0] = ADD(s[0], a);  s[1] = ADD(s[1], b);                          \
+    s[2] = ADD(s[2], c);  s[3] = ADD(s[3], d);                          \
+    s[4] = ADD(s[4], e);  s[5] = ADD(s[5], f);                          \
+    s[6] = ADD(s[6], g);  s[7] = ADD(s[7], h)
+#define BIG_SIGMA0(x) XOR3(ROT(x, 28), ROT(x, 34), ROT(x, 39))
+#define BIG_SIGMA1(x) XOR3(ROT(x, 14), ROT(x, 18), ROT(x, 41))
+#define LIT_SIGMA0(x) XOR3(ROT(x,  1), ROT(x,  8), SHR(x, 7))
+#define LIT_SIGMA1(x) XOR3(ROT(x, 19), ROT(x, 61), SHR(x, 6))
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+#define ADD(x, y) _mm256_add_epi64(x, y)
+#define SHR(x, c) _mm256_srli_epi64(x, c)
+#define SET1(x)   _mm256_set1_epi64x((long long)(x))
+#ifdef __AVX512VL__
+#define ROT(x, c)     _mm256_ror_epi64(x, c)
+#define XOR3(x, y, z) _mm256_ternarylogic_epi64(x, y, z, 0x96)
+#define CH(x, y, z)   _mm256_ternarylogic_epi64(x, y, z, 0xca)
+#define MAJ(x, y, z)  _mm256_ternarylogic_epi64(x, y, z, 0xe8)
+#else
+#define ROT(x, c)     _mm256_or_si256(_mm256_srli_epi64(x, c),           \
+                                      _mm256_slli_epi64(x, 64 - (c)))
+#define XOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define CH(x, y, z)   _mm256_xor_si256(_mm256_and_si256(x, y),           \
+                                       _mm256_andnot_si256(x, z))
+#define MAJ(x, y, z)  _mm256_or_si256(_mm256_and_si256(x, y),            \
+                                      _mm256_and_si256(z,                \
+                                                       _mm256_or_si256(x, y)))
+#endif
+
+// Transposes a 4x4 matrix of 64-bit words (4 rows of 4 words).
+// Copy of transpose_x4() in monocypher.c: this file stands alone.
+static void sha512_transpose_x4(__m256i out[4], const __m256i in[4])
+{
+    __m256i t0 = _mm256_unpacklo_epi64(in[0], in[1]);
+    __m256i t1 = _mm256_unpackhi_epi64(in[0], in[1]);
+    __m256i t2 = _mm256_unpacklo_epi64(in[2], in[3]);
+    __m256i t3 = _mm256_unpackhi_epi64(in[2], in[3]);
+    out[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+    out[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+    out[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+    out[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+static void sha512_compress_x4(crypto_sha512_ctx ctx[4], const u8 *block[4])
+{
+    const __m256i bswap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+                                           15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0,
+                                           15, 14, 13, 12, 11, 10, 9, 8);
+    __m256i rows[4];
+    __m256i w[16];
+    FOR (k, 0, 4) { // message words (big endian)
+        FOR (i, 0, 4) {
+            rows[i] = _mm256_loadu_si256((const __m256i*)block[i] + k);
+            rows[i] = _mm256_shuffle_epi8(rows[i], bswap);
+        }
+        sha512_transpose_x4(w + k*4, rows);
+    }
+    __m256i s[8];
+    FOR (k, 0, 2) { // state
+        FOR (i, 0, 4) {
+            rows[i] = _mm256_loadu_si256((const __m256i*)ctx[i].hash + k);
+        }
+        sha512_transpose_x4(s + k*4, rows);
+    }
+    __m256i a, b, c, d, e, f, g, h;
+    LANE_COMPRESS;
+    FOR (k, 0, 2) {
+        sha512_transpose_x4(rows, s + k*4);
+        FOR (i, 0, 4) {
+            _mm256_storeu_si256((__m256i*)ctx[i].hash + k, rows[i]);
+        }
     }
 }
+#undef ADD
+#undef SHR
+#undef SET1
+#undef ROT
+#undef XOR3
+#undef CH
+#undef MAJ
+#endif // __AVX2__
 
-static void sha512_update(crypto_sha512_ctx *ctx,
-                          const u8 *message, size_t message_size)
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#define ADD(x, y)     _mm512_add_epi64(x, y)
+#define SHR(x, c)     _mm512_srli_epi64(x, c)
+#define SET1(x)       _mm512_set1_epi64((long long)(x))
+#define ROT(x, c)     _mm512_ror_epi64(x, c)
+#define XOR3(x, y, z) _mm512_ternarylogic_epi64(x, y, z, 0x96)
+#define CH(x, y, z)   _mm512_ternarylogic_epi64(x, y, z, 0xca)
+#define MAJ(x, y, z)  _mm512_ternarylogic_epi64(x, y, z, 0xe8)
+
+// Transposes an 8x8 matrix of 64-bit words (8 rows of 8 words).
+// Copy of transpose_x8() in monocypher.c: this file stands alone.
+static void sha512_transpose_x8(__m512i out[8], const __m512i in[8])
 {
-    FOR (i, 0, message_size) {
-        sha512_set_input(ctx, message[i]);
-        ctx->input_idx++;
-        sha512_end_block(ctx);
+    __m512i t[8];
+    __m512i u[8];
+    FOR (i, 0, 4) {
+        t[i*2    ] = _mm512_unpacklo_epi64(in[i*2], in[i*2 + 1]);
+        t[i*2 + 1] = _mm512_unpackhi_epi64(in[i*2], in[i*2 + 1]);
+    }
+    FOR (i, 0, 2) { // rows 4i to 4i+3, gathered by pairs of words
+        const __m512i *ti = t + i*4;
+        u[i*4    ] = _mm512_shuffle_i64x2(ti[0], ti[2], 0x88); // words 0, 4
+        u[i*4 + 1] = _mm512_shuffle_i64x2(ti[0], ti[2], 0xdd); // words 2, 6
+        u[i*4 + 2] = _mm512_shuffle_i64x2(ti[1], ti[3], 0x88); // words 1, 5
+        u[i*4 + 3] = _mm512_shuffle_i64x2(ti[1], ti[3], 0xdd); // words 3, 7
+    }
+    out[0] = _mm512_shuffle_i64x2(u[0], u[4], 0x88);
+    out[4] = _mm512_shuffle_i64x2(u[0], u[4], 0xdd);
+    out[2] = _mm512_shuffle_i64x2(u[1], u[5], 0x88);
+    out[6] = _mm512_shuffle_i64x2(u[1], u[5], 0xdd);
+    out[1] = _mm512_shuffle_i64x2(u[2], u[6], 0x88);
+    out[5] = _mm512_shuffle_i64x2(u[2], u[6], 0xdd);
+    out[3] = _mm512_shuffle_i64x2(u[3], u[7], 0x88);
+    out[7] = _mm512_shuffle_i64x2(u[3], u[7], 0xdd);
+}
+
+static void sha512_compress_x8(crypto_sha512_ctx ctx[8], const u8 *block[8])
+{
+    const __m512i bswap = _mm512_set4_epi32(0x08090a0b, 0x0c0d0e0f,
+                                            0x00010203, 0x04050607);
+    __m512i rows[8];
+    __m512i w[16];
+    FOR (k, 0, 2) { // message words (big endian)
+        FOR (i, 0, 8) {
+            rows[i] = _mm512_loadu_si512(block[i] + k*64);
+            rows[i] = _mm512_shuffle_epi8(rows[i], bswap);
+        }
+        sha512_transpose_x8(w + k*8, rows);
+    }
+    __m512i s[8];
+    FOR (i, 0, 8) { // state
+        rows[i] = _mm512_loadu_si512(ctx[i].hash);
+    }
+    sha512_transpose_x8(s, rows);
+    __m512i a, b, c, d, e, f, g, h;
+    LANE_COMPRESS;
+    sha512_transpose_x8(rows, s);
+    FOR (i, 0, 8) {
+        _mm512_storeu_si512(ctx[i].hash, rows[i]);
+    }
+}
+#undef ADD
+#undef SHR
+#undef SET1
+#undef ROT
+#undef XOR3
+#undef CH
+#undef MAJ
+#endif // __AVX512F__ && __AVX512BW__
+#undef LANE_SCHEDULE
+#undef LANE_ROUND
+#undef LANE_ROUNDS_16
+#undef LANE_COMPRESS
+#undef BIG_SIGMA0
+#undef BIG_SIGMA1
+#undef LIT_SIGMA0
+#undef LIT_SIGMA1
+
+// Compresses one block for each of the nb_lanes contexts, using the
+// widest kernel available, and the scalar version for the rest.
+static void sha512_compress_lanes(crypto_sha512_ctx *ctx, const u8 *block[],
+                                  size_t nb_lanes)
+{
+    size_t i = 0;
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+    for (; i + 8 <= nb_lanes; i += 8) {
+        sha512_compress_x8(ctx + i, block + i);
+    }
+#endif
+#ifdef __AVX2__
+    for (; i + 4 <= nb_lanes; i += 4) {
+        sha512_compress_x4(ctx + i, block + i);
+    }
+#endif
+    for (; i < nb_lanes; i++) {
+        sha512_compress(ctx + i, block[i]);
     }
 }
 
@@ -151,52 +389,76 @@ void crypto_sha512_init(crypto_sha512_ctx *ctx)
 void crypto_sha512_update(crypto_sha512_ctx *ctx,
                           const u8 *message, size_t message_size)
 {
-    // Align ourselves with block boundaries
-    size_t align = MIN(ALIGN(ctx->input_idx, 128), message_size);
-    sha512_update(ctx, message, align);
-    message      += align;
-    message_size -= align;
-
-    // Process the message block by block
-    FOR (i, 0, message_size / 128) { // number of blocks
-        FOR (j, 0, 16) {
-            ctx->input[j] = load64_be(message + j*8);
+    // Fill the buffer, and compress it once full
+    if (ctx->input_idx > 0) {
+        size_t fill = MIN(128 - ctx->input_idx, message_size);
+        FOR (i, 0, fill) {
+            ctx->input[ctx->input_idx + i] = message[i];
+        }
+        ctx->input_idx += fill;
+        message        += fill;
+        message_size   -= fill;
+        if (ctx->input_idx < 128) {
+            return;
         }
-        message        += 128;
-        ctx->input_idx += 128;
-        sha512_end_block(ctx);
+        sha512_compress_block(ctx, ctx->input);
+        ctx->input_idx = 0;
+    }
+
+    // Process the message block by block, straight from the message
+    size_t nb_blocks = message_size >> 7;
+    FOR (i, 0, nb_blocks) {
+        sha512_compress_block(ctx, message);
+        message += 128;
     }
     message_size &= 127;
 
     // remaining bytes
-    sha512_update(ctx, message, message_size);
+    FOR (i, 0, message_size) {
+        ctx->input[i] = message[i];
+    }
+    ctx->input_idx = message_size;
 }
 
-void crypto_sha512_final(crypto_sha512_ctx *ctx, u8 hash[64])
+// Pads the message.  Compresses the penultimate block if there is one,
+// so only the last block remains in the buffer.
+static void sha512_pad(crypto_sha512_ctx *ctx)
 {
     sha512_incr(ctx->input_size, ctx->input_idx * 8); // size is in bits
-    sha512_set_input(ctx, 128);                       // padding
+    ctx->input[ctx->input_idx++] = 128;               // padding
 
     // compress penultimate block (if any)
-    if (ctx->input_idx > 111) {
-        sha512_compress(ctx);
-        FOR(i, 0, 14) {
+    if (ctx->input_idx > 112) {
+        FOR (i, ctx->input_idx, 128) {
             ctx->input[i] = 0;
         }
+        sha512_compress(ctx, ctx->input);
+        ctx->input_idx = 0;
     }
-    // compress last block
-    ctx->input[14] = ctx->input_size[0];
-    ctx->input[15] = ctx->input_size[1];
-    sha512_compress(ctx);
+    // last block
+    FOR (i, ctx->input_idx, 112) {
+        ctx->input[i] = 0;
+    }
+    store64_be(ctx->input + 112, ctx->input_size[0]);
+    store64_be(ctx->input + 120, ctx->input_size[1]);
+}
 
-    // copy hash to output (big endian)
+// copy hash to output (big endian)
+static void sha512_output(crypto_sha512_ctx *ctx, u8 hash[64])
+{
     FOR (i, 0, 8) {
         store64_be(hash + i*8, ctx->hash[i]);
     }
-
     WIPE_CTX(ctx);
 }
 
+void crypto_sha512_final(crypto_sha512_ctx *ctx, u8 hash[64])
+{
+    sha512_pad(ctx);
+    sha512_compress(ctx, ctx->input); // compress last block
+    sha512_output(ctx, hash);
+}
+
 void crypto_sha512(u8 *hash, const u8 *message, size_t message_size)
 {
     crypto_sha512_ctx ctx;
@@ -204,3 +466,70 @@ void crypto_sha512(u8 *hash, const u8 *message, size_t message_size)
     crypto_sha512_update(&ctx, message, message_size);
     crypto_sha512_final (&ctx, hash);
 }
+
+// Hashes up to 8 messages at once, one message per lane.  The blocks
+// all messages have are compressed together.  The extra blocks of the
+// longer messages are compressed one by one.  The last blocks are
+// compressed together again.
+static void sha512_lanes(u8 *hash[], const u8 *message[],
+                         const size_t message_size[], const size_t idx[],
+                         size_t nb_lanes)
+{
+    crypto_sha512_ctx ctx[8];
+    const u8         *block[8];
+    size_t            nb_blocks = 0; // blocks all messages have
+    FOR (i, 0, nb_lanes) {
+        size_t n  = message_size[idx[i]] >> 7;
+        nb_blocks = i == 0 ? n : MIN(nb_blocks, n);
+        crypto_sha512_init(ctx + i);
+    }
+    FOR (b, 0, nb_blocks) {
+        FOR (i, 0, nb_lanes) {
+            sha512_incr(ctx[i].input_size, 1024);
+            block[i] = message[idx[i]] + b * 128;
+        }
+        sha512_compress_lanes(ctx, block, nb_lanes);
+    }
+    FOR (i, 0, nb_lanes) {
+        crypto_sha512_update(ctx + i, message     [idx[i]] + nb_blocks * 128,
+                                      message_size[idx[i]] - nb_blocks * 128);
+        sha512_pad(ctx + i);
+        block[i] = ctx[i].input;
+    }
+    sha512_compress_lanes(ctx, block, nb_lanes);
+    FOR (i, 0, nb_lanes) {
+        sha512_output(ctx + i, hash[idx[i]]);
+    }
+}
+
+// Messages are taken 64 at a time, and sorted by size, so each group
+// of lanes gets messages of similar sizes.
+#define BATCH_SIZE 64
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#define NB_LANES 8
+#else
+#define NB_LANES 4
+#endif
+
+void crypto_sha512_batch(u8 *hash[], const u8 *message[],
+                         const size_t message_size[], size_t nb_messages)
+{
+    size_t idx[BATCH_SIZE];
+    for (size_t start = 0; start < nb_messages; start += BATCH_SIZE) {
+        size_t nb = MIN(BATCH_SIZE, nb_messages - start);
+        // insertion sort of the indices, by message size
+        FOR (i, 0, nb) {
+            size_t n = start + i;
+            size_t j = i;
+            while (j > 0 && message_size[idx[j-1]] > message_size[n]) {
+                idx[j] = idx[j-1];
+                j--;
+            }
+            idx[j] = n;
+        }
+        for (size_t i = 0; i < nb; i += NB_LANES) {
+            sha512_lanes(hash, message, message_size, idx + i,
+                         MIN(NB_LANES, nb - i));
+        }
+    }
+}
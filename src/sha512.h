@@ -5,9 +5,8 @@
 #include <inttypes.h>
 
 typedef struct {
-    uint64_t w[80]; // work area
     uint64_t hash[8];
-    uint64_t input[16];
+    uint8_t  input[128];
     uint64_t input_size[2];
     size_t   input_idx;
 } crypto_sha512_ctx;
@@ -19,4 +18,10 @@ void crypto_sha512_final (crypto_sha512_ctx *ctx, uint8_t hash[64]);
 
 void crypto_sha512(uint8_t *out,const uint8_t *message, size_t message_size);
 
+// Hashes nb_messages independent messages, 4 or 8 at a time (one per
+// SIMD lane).  Messages of similar sizes are grouped together, so they
+// can be of any size.  Same results as calling crypto_sha512() on each.
+void crypto_sha512_batch(uint8_t *hash[], const uint8_t *message[],
+                         const size_t message_size[], size_t nb_messages);
+
 #endif // SHA512_H
@@ -0,0 +1,118 @@
+#define _GNU_SOURCE // syscall(io_uring_setup, ...)
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// The kernel reads and writes the rings concurrently with us.
+#define LOAD_ACQUIRE(p)     __atomic_load_n (p,    __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, x) __atomic_store_n(p, x, __ATOMIC_RELEASE)
+
+static void* map_ring(int fd, size_t size, off_t offset)
+{
+    return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, offset);
+}
+
+static void unmap_ring(void *ring, size_t size)
+{
+    if (ring != MAP_FAILED) {
+        munmap(ring, size);
+    }
+}
+
+int uring_init(uring *ring, unsigned nb_entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(SYS_io_uring_setup, nb_entries, &p);
+    if (ring->fd == -1) {
+        return -1; // no io_uring (old kernel, seccomp filter...)
+    }
+    // IORING_FEAT_RW_CUR_POS came with Linux 5.6, like the
+    // IORING_OP_OPENAT, IORING_OP_READ, and IORING_OP_CLOSE operations.
+    // Older kernels would fail every single request.
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes
+                       + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes    = map_ring(ring->fd, ring->sqes_size   , IORING_OFF_SQES   );
+    if (ring->sq_ring == MAP_FAILED ||
+        ring->cq_ring == MAP_FAILED ||
+        ring->sqes    == MAP_FAILED) {
+        uring_free(ring);
+        return -1;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head    = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail    = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask    = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array   = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head    = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail    = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask    = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->nb_pending = 0;
+    return 0;
+}
+
+void uring_free(uring *ring)
+{
+    unmap_ring(ring->sq_ring, ring->sq_ring_size);
+    unmap_ring(ring->cq_ring, ring->cq_ring_size);
+    unmap_ring(ring->sqes   , ring->sqes_size   );
+    close(ring->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring *ring)
+{
+    unsigned head = LOAD_ACQUIRE(ring->sq_head);
+    unsigned tail = *ring->sq_tail + ring->nb_pending;
+    if (tail - head > *ring->sq_mask) {
+        return 0; // ring is full
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->nb_pending++;
+    struct io_uring_sqe *sqe = ring->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring *ring)
+{
+    // Publish the queued entries
+    STORE_RELEASE(ring->sq_tail, *ring->sq_tail + ring->nb_pending);
+    ring->nb_pending = 0;
+    int status;
+    do {
+        // Includes entries a previous call failed to submit, if any
+        unsigned to_submit = *ring->sq_tail - LOAD_ACQUIRE(ring->sq_head);
+        status = (int)syscall(SYS_io_uring_enter, ring->fd, to_submit, 1,
+                              IORING_ENTER_GETEVENTS, 0, 0);
+    } while (status == -1 && errno == EINTR);
+    return status == -1 ? -1 : 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == LOAD_ACQUIRE(ring->cq_tail)) {
+        return 0;
+    }
+    return ring->cqes + (head & *ring->cq_mask);
+}
+
+void uring_cqe_seen(uring *ring)
+{
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
@@ -0,0 +1,46 @@
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper, straight on top of the system calls.
+// (Avoids the dependency on liburing.)
+typedef struct {
+    // Private stuff. (Don't read, don't modify)
+    int                  fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t               sq_ring_size;
+    size_t               cq_ring_size;
+    size_t               sqes_size;
+    unsigned             nb_pending; // queued, but not submitted yet
+} uring;
+
+// Sets up a ring with room for nb_entries submissions.
+// Returns 0 on success, -1 if io_uring is unavailable.  Kernels older
+// than 5.6 count as unavailable: they lack open, read, and close.
+int uring_init(uring *ring, unsigned nb_entries);
+
+// Call this last
+void uring_free(uring *ring);
+
+// Returns the next free submission entry (zeroed), or 0 if the ring
+// is full.  The entry is queued until the next uring_submit_and_wait().
+struct io_uring_sqe* uring_get_sqe(uring *ring);
+
+// Submits queued entries, then waits until at least one completion is
+// available.  Must not be called with nothing in flight (it would wait
+// forever).  Returns 0 on success, -1 on failure (errno is set).
+int uring_submit_and_wait(uring *ring);
+
+// Returns the oldest available completion, or 0 if there is none.
+// Call uring_cqe_seen() once done with it.
+struct io_uring_cqe* uring_peek_cqe(uring *ring);
+void uring_cqe_seen(uring *ring);
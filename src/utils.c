@@ -1,9 +1,12 @@
-#define _GNU_SOURCE // syscall(getrandom, ...)
+#define _GNU_SOURCE // syscall(getrandom, ...), MAP_HUGETLB, MADV_HUGEPAGE
 #include "utils.h"
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 
 static int is_between(char c, char start, char end)
@@ -19,8 +22,8 @@ static int int_of_digit(char c)
 static int int_of_hex(char c)
 {
     return is_between(c, '0', '9') ? c - '0'
-        :  is_between(c, 'a', 'f') ? c - 'a'
-        :  is_between(c, 'A', 'F') ? c - 'A'
+        :  is_between(c, 'a', 'f') ? c - 'a' + 10
+        :  is_between(c, 'A', 'F') ? c - 'A' + 10
         :  -1;
 }
 
@@ -44,6 +47,58 @@ void* alloc(size_t size)
     return buf;
 }
 
+// Huge page size on x86-64 and most 64-bit ARM kernels
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static size_t round_to_huge_pages(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+void* alloc_pages(size_t size)
+{
+    if (size == 0) { return 0; } // for portability
+    size_t length = round_to_huge_pages(size);
+    int    prot   = PROT_READ | PROT_WRITE;
+    int    flags  = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    // Reserved huge pages (see /proc/sys/vm/nr_hugepages), if any
+    void *buf = mmap(0, length, prot, flags | MAP_HUGETLB, -1, 0);
+    if (buf != MAP_FAILED) {
+        return buf;
+    }
+    // Regular pages, aligned on a huge page boundary so the kernel
+    // can back them with transparent huge pages.
+    size_t   padded = length + HUGE_PAGE_SIZE;
+    uint8_t *raw    = mmap(0, padded, prot, flags, -1, 0);
+    if (raw == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate 0x%zx bytes\n", size);
+        panic("Out of memory.");
+    }
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)raw % HUGE_PAGE_SIZE)
+                % HUGE_PAGE_SIZE;
+    size_t tail = padded - head - length;
+    if (head > 0) { munmap(raw, head);                 }
+    if (tail > 0) { munmap(raw + head + length, tail); }
+    madvise(raw + head, length, MADV_HUGEPAGE); // Just a hint, may fail
+    return raw + head;
+}
+
+void free_pages(void *buf, size_t size)
+{
+    if (buf != 0) {
+        munmap(buf, round_to_huge_pages(size));
+    }
+}
+
+void touch_pages(void *buf, size_t size)
+{
+    volatile uint8_t *bytes = (uint8_t*)buf;
+    for (size_t i = 0; i < size; i += 4096) {
+        bytes[i] = 0;
+    }
+}
+
 void random_bytes(uint8_t *buffer, size_t buffer_size)
 {
     if (buffer_size > 256 ) {
@@ -77,6 +132,27 @@ int int_of_string(const char *s)
     return i;
 }
 
+int size_of_string(size_t *size, const char *s)
+{
+    size_t i = 0;
+    if ( s == 0                  ) return -1; // NULL  string
+    if (!is_between(*s, '0', '9')) return -2; // empty, or not a number
+    while (is_between(*s, '0', '9')) {
+        if (i > (SIZE_MAX - int_of_digit(*s)) / 10) return -3; // too big
+        i = (10 * i) + int_of_digit(*s);
+        s++;
+    }
+    unsigned shift = *s == 'K' ? 10
+        :            *s == 'M' ? 20
+        :            *s == 'G' ? 30
+        :            0;
+    if (shift != 0) { s++; }
+    if (*s != '\0'             ) return -2; // trailing garbage
+    if (i > (SIZE_MAX >> shift)) return -3; // too big for size_t
+    *size = i << shift;
+    return 0;
+}
+
 void print_buffer(const uint8_t *buffer, size_t buffer_size)
 {
     for (size_t i = 0; i < buffer_size; i++) {
@@ -89,7 +165,7 @@ int read_buffer(uint8_t *out, size_t max_size, const char *hex)
     size_t hex_size = string_length(hex);
     size_t buf_size = hex_size / 2;
     if (hex ==  0          ) return -1;
-    if (hex_size > max_size) return -2;
+    if (buf_size > max_size) return -2;
     if (hex_size % 2 !=   0) return -3;
     for (size_t i = 0; i < hex_size; i += 2) {
         int msb = int_of_hex(hex[i  ]);
@@ -129,6 +205,118 @@ void free_vector(vector *v)
     v->size = 0;
 }
 
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          next_job;
+    size_t          nb_jobs;
+    void          (*job)(void *arg, size_t i);
+    void           *arg;
+} parallel_ctx;
+
+static void* parallel_worker(void *ctx_ptr)
+{
+    parallel_ctx *ctx = (parallel_ctx*)ctx_ptr;
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        size_t i = ctx->next_job++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (i >= ctx->nb_jobs) { return 0; }
+        ctx->job(ctx->arg, i);
+    }
+}
+
+void parallel_for(size_t nb_jobs, size_t nb_threads,
+                  void (*job)(void *arg, size_t i), void *arg)
+{
+    parallel_ctx ctx;
+    pthread_mutex_init(&ctx.lock, 0);
+    ctx.next_job = 0;
+    ctx.nb_jobs  = nb_jobs;
+    ctx.job      = job;
+    ctx.arg      = arg;
+
+    // No point in having more threads than jobs
+    if (nb_threads > nb_jobs) { nb_threads = nb_jobs; }
+    if (nb_threads < 1      ) { nb_threads = 1;       }
+    pthread_t *threads = alloc((nb_threads - 1) * sizeof(pthread_t));
+    for (size_t i = 0; i < nb_threads - 1; i++) {
+        if (pthread_create(threads + i, 0, parallel_worker, &ctx)) {
+            panic("Could not create thread");
+        }
+    }
+    parallel_worker(&ctx); // the calling thread works too
+    for (size_t i = 0; i < nb_threads - 1; i++) {
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+    pthread_mutex_destroy(&ctx.lock);
+}
+
+// Each area is faulted in by several threads, one share each
+typedef struct {
+    area_pool *pool;
+    size_t     nb_shares; // per area
+} touch_ctx;
+
+static void touch_job(void *ctx_ptr, size_t i)
+{
+    touch_ctx *ctx   = (touch_ctx*)ctx_ptr;
+    size_t     size  = ctx->pool->area_size;
+    size_t     share = size / ctx->nb_shares;
+    size_t     nb    = i % ctx->nb_shares;
+    size_t     start = share * nb;
+    size_t     end   = nb == ctx->nb_shares - 1 ? size : start + share;
+    uint8_t   *area  = ctx->pool->areas[i / ctx->nb_shares];
+    touch_pages(area + start, end - start);
+}
+
+void pool_init(area_pool *pool, size_t area_size, size_t nb_areas,
+               size_t nb_threads)
+{
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_cond_init(&pool->released, 0);
+    pool->areas     = alloc(nb_areas * sizeof(void*));
+    pool->nb_free   = nb_areas;
+    pool->nb_areas  = nb_areas;
+    pool->area_size = area_size;
+    for (size_t i = 0; i < nb_areas; i++) {
+        pool->areas[i] = alloc_pages(area_size);
+    }
+    touch_ctx ctx;
+    ctx.pool      = pool;
+    ctx.nb_shares = nb_threads < 1 ? 1 : nb_threads;
+    parallel_for(nb_areas * ctx.nb_shares, nb_threads, touch_job, &ctx);
+}
+
+void* pool_acquire(area_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nb_free == 0) {
+        pthread_cond_wait(&pool->released, &pool->lock);
+    }
+    void *area = pool->areas[--pool->nb_free];
+    pthread_mutex_unlock(&pool->lock);
+    return area;
+}
+
+void pool_release(area_pool *pool, void *area)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->areas[pool->nb_free++] = area;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(area_pool *pool)
+{
+    for (size_t i = 0; i < pool->nb_areas; i++) {
+        free_pages(pool->areas[i], pool->area_size);
+    }
+    free(pool->areas);
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->lock);
+}
+
 static const char *usage_string = "";
 
 void set_usage_string(const char* usage)
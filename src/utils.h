@@ -1,9 +1,22 @@
 #include <stddef.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 // Allocate a buffer.  Panics if allocation fails
 void* alloc(size_t size);
 
+// Allocate a large, zeroed buffer, meant for random access (Argon2
+// work areas).  Uses huge pages when possible: reserved ones first,
+// then transparent huge pages, then regular pages.  Fewer page
+// faults, fewer TLB misses.  Panics if allocation fails.
+// Free with free_pages(), with the same size.
+void* alloc_pages(size_t size);
+void  free_pages (void *buf, size_t size);
+
+// Faults in the pages of a buffer (by writing zeroes), so the cost is
+// paid up front.  Several threads may touch separate parts at once.
+void touch_pages(void *buf, size_t size);
+
 // Fill buffer with random bytes.
 // Panics if buffer_size > 256, or if the system call fails (it shouldn't).
 void random_bytes(uint8_t *buffer, size_t buffer_size);
@@ -23,6 +36,16 @@ int string_equal(const char *a, const char *b);
 //   -3  : The number is too big to be represented as an int
 int int_of_string(const char *s);
 
+// Reads a size in bytes from a string, with an optional K, M, or G
+// suffix (powers of 1024).  The size is written to *size.
+//
+// Return values:
+//    0  : Success
+//   -1  : The string is NULL
+//   -2  : The string does not represent a size
+//   -3  : The size is too big to be represented as a size_t
+int size_of_string(size_t *size, const char *s);
+
 // Prints the contents of a buffer in hexadecimal form
 void print_buffer(const uint8_t *buffer, size_t buffer_size);
 
@@ -49,6 +72,40 @@ int read_vector(vector *v, const char *hex);
 
 void free_vector(vector *v);
 
+// Calls job(arg, i) for each i in [0, nb_jobs), using up to nb_threads
+// threads (the calling thread included).  Jobs are handed out in
+// increasing order, but may complete in any order.
+// Panics if a thread cannot be created.
+void parallel_for(size_t nb_jobs, size_t nb_threads,
+                  void (*job)(void *arg, size_t i), void *arg);
+
+// Pool of work areas (see alloc_pages()), allocated and faulted in
+// once, then handed out and taken back.  Repeated hashes (one area per
+// worker thread) pay neither allocation nor page faults.  Thread safe.
+typedef struct {
+    // Private stuff. (Don't read, don't modify)
+    pthread_mutex_t   lock;
+    pthread_cond_t    released;
+    void            **areas;    // the free ones come first
+    size_t            nb_free;
+    size_t            nb_areas;
+    size_t            area_size;
+} area_pool;
+
+// Allocates nb_areas areas of area_size bytes each, faulted in by up
+// to nb_threads threads.  Panics if allocation fails.
+void pool_init(area_pool *pool, size_t area_size, size_t nb_areas,
+               size_t nb_threads);
+
+// Takes a free area, waiting for one to be released if necessary.
+void* pool_acquire(area_pool *pool);
+
+// Gives back an area.  Wipe it first.
+void pool_release(area_pool *pool, void *area);
+
+// Frees all areas.  They must have been released.
+void pool_free(area_pool *pool);
+
 void set_usage_string(const char* usage); // sets usage string for user errors
 void usage();                  // Prints usage string and exits
 void error(const char *error); // Prints user    error, exits with code 1